@@ -1,7 +1,9 @@
 #include "tl_net.h"
+#include "net_glib.h"
 #include <iostream>
 #include <gtk/gtk.h>
 #include <thread>
+//Must match the CustomInfoTypes of the server value for value
 enum CustomInfoTypes : uint32_t
 {
 	CONNECTION_ACCEPTED,
@@ -12,14 +14,38 @@ enum CustomInfoTypes : uint32_t
 	MP4,
 	MPEG_2,
 	M4V,
-	FLV
+	FLV,
+	FILE_OPEN,
+	FILE_CHUNK,
+	FILE_ACK,
+	PLAYBACK_REQUEST,
+	PLAYBACK_COMMAND
+};
+
+//Control infos overtake file chunks that are already queued, so pings and acks stay quick during a cast
+template<>
+struct tl::net::info_lane<CustomInfoTypes>
+{
+	static tl::net::send_lane Of(CustomInfoTypes id)
+	{
+		switch (id)
+		{
+		case CustomInfoTypes::FILE_CHUNK:
+			return tl::net::send_lane::bulk;
+		case CustomInfoTypes::FILE_OPEN:
+			return tl::net::send_lane::interactive;
+		default:
+			return tl::net::send_lane::control;
+		}
+	}
 };
 
 enum CustomUserCommands : uint32_t
 {
 	SEND_SERVER_PING,
 	SEND_SERVER_PLAY,
-	SEND_SERVER_PAUSE
+	SEND_SERVER_PAUSE,
+	SEND_SERVER_FILE
 };
 
 
@@ -27,11 +53,80 @@ class CustomClient : public tl::net::client_interface<CustomInfoTypes, CustomUse
 {
 public:
 	CustomClient()
+		: fileSender({ CustomInfoTypes::FILE_OPEN, CustomInfoTypes::FILE_CHUNK, CustomInfoTypes::FILE_ACK },
+			[this](tl::net::info<CustomInfoTypes>&& info) { Send(std::move(info)); })
 	{
 		app = gtk_application_new ("org.gtk.example", G_APPLICATION_DEFAULT_FLAGS);
   		
 	}
 
+	//Streams the file last chosen in the window to the server
+	void CastFile()
+	{
+		std::string filePath;
+		{
+			std::scoped_lock lock(muxChosenFile);
+			filePath = chosenFilePath;
+		}
+
+		if (fileSender.IsActive())
+		{
+			std::cout << "a file is already being cast\n";
+			return;
+		}
+
+		if (!fileSender.Open(filePath, MediaTypeOf(filePath)))
+			std::cout << "could not open " << filePath << std::endl;
+	}
+
+	//Acks for the file being cast come back through here
+	bool OnFileTransferInfo(tl::net::info<CustomInfoTypes>& info)
+	{
+		bool bHandled = fileSender.OnInfo(info);
+		if (bHandled && !fileSender.IsActive())
+			std::cout << "cast " << fileSender.GetAckedBytes() << " of " << fileSender.GetFileSize() << " bytes\n";
+		return bHandled;
+	}
+
+	//After a reconnect, carries on with the file being cast from where the server got to
+	void ResumeCast()
+	{
+		if (fileSender.Resume())
+			std::cout << "resuming cast from byte " << fileSender.GetAckedBytes() << "\n";
+	}
+
+	//Asks the server to play or pause every receiver, this one included
+	void RequestPlayback(tl::net::playback_action action)
+	{
+		Send(tl::net::MakePlaybackRequest<CustomInfoTypes>(
+			{ CustomInfoTypes::PLAYBACK_REQUEST, CustomInfoTypes::PLAYBACK_COMMAND }, action));
+	}
+
+	//The server says when to act on its clock, so wait for that instant rather than acting on arrival
+	void OnPlaybackCommand(tl::net::info<CustomInfoTypes>& info)
+	{
+		tl::net::playback_command command;
+		if (!tl::net::ReadPlaybackCommand(info, command))
+			return;
+
+		RunAtServerTime(command.nServerTime, [command]()
+			{
+				double dPosition = std::chrono::duration<double>(std::chrono::nanoseconds(command.nPosition)).count();
+				switch (command.action)
+				{
+				case tl::net::playback_action::play:
+					std::cout << "playing from " << dPosition << "s\n";
+					break;
+				case tl::net::playback_action::pause:
+					std::cout << "paused at " << dPosition << "s\n";
+					break;
+				case tl::net::playback_action::seek:
+					std::cout << "seeked to " << dPosition << "s\n";
+					break;
+				}
+			});
+	}
+
 	void PingServer()
 	{
 		tl::net::info<CustomInfoTypes> info;
@@ -44,6 +139,36 @@ public:
 		Send(info);
 	}
 
+	//Called from the GTK main loop whenever an info has come in, a button has been clicked or the connection has
+	//closed. Everything queued is handled before returning, as nothing more is signalled for it.
+	void OnReady()
+	{
+		//Infos that arrived just before the connection closed, such as the final ack of a cast, are handled before
+		//giving up or reconnecting, so they are never lost or applied to the next session
+		while (!Incoming().empty())
+		{
+			auto info = Incoming().pop_front().info_;
+			OnServerInfo(info);
+		}
+
+		while (!UserCommands().empty())
+			OnUserCommand(UserCommands().pop_front().id);
+
+		if (!IsConnected())
+		{
+			OnConnectionLost();
+			return;
+		}
+
+		//Once the server has taken the session back, the transfer picks up from the last acknowledged chunk
+		if (bResumePending && IsResumed())
+		{
+			bResumePending = false;
+			nReconnects = 0;
+			ResumeCast();
+		}
+	}
+
 	void runWindow()
 	{
 		g_signal_connect (app, "activate", G_CALLBACK (activate), this);
@@ -57,6 +182,105 @@ public:
 	}
 
 private:
+	void OnServerInfo(tl::net::info<CustomInfoTypes>& info)
+	{
+		std::cout << "incoming packet header id: " << info.header.id << std::endl;
+
+		if (OnFileTransferInfo(info))
+			return;
+
+		switch (info.header.id)
+		{
+		case CustomInfoTypes::GIF:
+			{
+			std::chrono::system_clock::time_point timeNow = std::chrono::system_clock::now();
+			std::chrono::system_clock::time_point timeThen;
+			info >> timeThen;
+			std::cout << "Ping: " << std::chrono::duration<double>(timeNow - timeThen).count() << std::endl;
+
+			}
+			break;
+		case CustomInfoTypes::CONNECTION_ACCEPTED:
+			std::cout << "Server Accepted Connection\n";
+			break;
+		case CustomInfoTypes::CONNECTION_VERIFIED:
+			//Also sent when a reconnect found our session expired
+			std::cout << "Server Verified Connection\n";
+			bResumePending = false;
+			nReconnects = 0;
+			break;
+		case CustomInfoTypes::PLAYBACK_COMMAND:
+			OnPlaybackCommand(info);
+			break;
+		}
+	}
+
+	void OnUserCommand(CustomUserCommands user_command)
+	{
+		switch(user_command)
+		{
+			case CustomUserCommands::SEND_SERVER_PING:
+				PingServer();
+				break;
+			case CustomUserCommands::SEND_SERVER_PLAY:
+				std::cout<<"sending play command to server\n";
+				RequestPlayback(tl::net::playback_action::play);
+				break;
+			case CustomUserCommands::SEND_SERVER_PAUSE:
+				std::cout<<"send pause command to server\n";
+				RequestPlayback(tl::net::playback_action::pause);
+				break;
+			case CustomUserCommands::SEND_SERVER_FILE:
+				std::cout<<"casting file to server\n";
+				CastFile();
+				break;
+		}
+	}
+
+	void OnConnectionLost()
+	{
+		if (bReconnectScheduled)
+			return;
+
+		if (GetSession().IsValid() && nReconnects < 5)
+		{
+			//The server keeps our session for a while, so a dropped link costs a reconnect rather than the cast.
+			//The wait is a GLib timeout rather than a sleep so the window stays responsive.
+			std::cout << "Connection lost, reconnecting\n";
+			nReconnects++;
+			bReconnectScheduled = true;
+			g_timeout_add(500 * nReconnects, reconnect_proxy, this);
+		}
+		else
+		{
+			std::cout << "Server Down\n";
+			g_application_quit(G_APPLICATION(app));
+		}
+	}
+
+	static gboolean reconnect_proxy(gpointer data)
+	{
+		CustomClient *_this = static_cast<CustomClient*>(data);
+		_this->bReconnectScheduled = false;
+		_this->bResumePending = true;
+		_this->Reconnect();
+		return G_SOURCE_REMOVE;
+	}
+
+	static CustomInfoTypes MediaTypeOf(const std::string& filePath)
+	{
+		std::string extension = filePath.substr(filePath.find_last_of('.') + 1);
+		std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+
+		if (extension == "webm") return CustomInfoTypes::WEBM;
+		if (extension == "gif") return CustomInfoTypes::GIF;
+		if (extension == "avi") return CustomInfoTypes::AVI;
+		if (extension == "m4v") return CustomInfoTypes::M4V;
+		if (extension == "flv") return CustomInfoTypes::FLV;
+		if (extension == "mpg" || extension == "mpeg" || extension == "ts") return CustomInfoTypes::MPEG_2;
+		return CustomInfoTypes::MP4;
+	}
+
 	void pause (gpointer data)
 	{
 			CustomClient *_this = static_cast<CustomClient*>(data);
@@ -98,6 +322,12 @@ private:
 
 		  gtk_text_set_buffer(GTK_TEXT(_this->chosen_file_path_txt), buff);
 
+		  {
+			  std::scoped_lock lock(_this->muxChosenFile);
+			  _this->chosenFilePath = filePath;
+		  }
+		  _this->addToUserCommands(CustomUserCommands::SEND_SERVER_FILE);
+
 	    }
 
 	  gtk_window_destroy (GTK_WINDOW (dialog));
@@ -187,8 +417,16 @@ private:
 		}
 
 	GtkApplication *app;
+	tl::net::file_sender<CustomInfoTypes> fileSender;
+	//Written by the file dialog, read when its user command is handled
+	std::mutex muxChosenFile;
+	std::string chosenFilePath;
 	static GtkWindow *parent_window;
 	static GtkWidget *chosen_file_path_txt;
+	//Reconnecting after the link drops, only touched from the GTK main loop
+	int nReconnects = 0;
+	bool bResumePending = false;
+	bool bReconnectScheduled = false;
 
 
 };
@@ -198,77 +436,15 @@ GtkWidget* CustomClient::chosen_file_path_txt = nullptr;
 
 int main()
 {
-	std::thread t1;
 	CustomClient c;
-	c.Connect("127.0.0.1", 60000);
-
-	bool bQuit = false;
-
-	while (!bQuit)
-	{
-
-		if (c.IsConnected())
-		{
+	//A server on this machine is reached through shared memory, without going through the TCP stack at all
+	if (!c.ConnectSharedMemory("/tmp/tl_net_simple_server.sock"))
+		c.Connect("127.0.0.1", 60000);
 
-			if (!c.Incoming().empty())
-			{
-				std::cout << "received incoming packet\n";
-				auto info = c.Incoming().pop_front().info_;
-
-				std::cout << "incoming packet header id: " << info.header.id << std::endl;
-
-				switch (info.header.id)
-				{
-				case CustomInfoTypes::GIF:
-					{
-					std::chrono::system_clock::time_point timeNow = std::chrono::system_clock::now();
-					std::chrono::system_clock::time_point timeThen;
-					info >> timeThen;
-					std::cout << "Ping: " << std::chrono::duration<double>(timeNow - timeThen).count() << std::endl;
-
-					}
-					break;
-				case CustomInfoTypes::CONNECTION_ACCEPTED:
-					std::cout << "Server Accepted Connection\n";
-					break;
-				case CustomInfoTypes::CONNECTION_VERIFIED:
-					std::cout<<"creating thread with address: "<<&c<<std::endl;
-					t1 = std::thread(&CustomClient::runWindow, &c);
-					break;
-
-				}
-
-
-
-			}
-
-			if(!c.UserCommands().empty())
-			{
-				auto user_command = c.UserCommands().pop_front().id;
-
-
-				switch(user_command)
-				{
-					case CustomUserCommands::SEND_SERVER_PING:
-						c.PingServer();
-						break;
-					case CustomUserCommands::SEND_SERVER_PLAY:
-						std::cout<<"sending play command to server\n";
-						break;
-					case CustomUserCommands::SEND_SERVER_PAUSE:
-						std::cout<<"send pause command to server\n";
-						break;
-				}
-			}
-		}
-		else
-		{
-			std::cout << "Server Down\n";
-			bQuit = true;
-		}
-	}
+	//Infos from the server and clicks in the window are both dispatched from the GTK main loop, which sleeps until
+	//one of them comes in
+	tl::net::AttachReadiness(c.Ready(), [&c]() { c.OnReady(); });
+	c.runWindow();
 
 	return 0;
-
-
 }
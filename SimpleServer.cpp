@@ -1,23 +1,56 @@
 #include <iostream>
+#include <filesystem>
 #include <tl_net.h>
 
+//Must match the CustomInfoTypes of the client value for value
 enum class CustomInfoTypes : uint32_t
 {
 	CONNECTION_ACCEPTED,
+	CONNECTION_VERIFIED,
 	WEBM,
 	GIF,
 	AVI,
 	MP4,
 	MPEG_2,
 	M4V,
-	FLV
+	FLV,
+	FILE_OPEN,
+	FILE_CHUNK,
+	FILE_ACK,
+	PLAYBACK_REQUEST,
+	PLAYBACK_COMMAND
 };
 
+//Control infos overtake file chunks that are already queued, so pings and acks stay quick during a cast
+template<>
+struct tl::net::info_lane<CustomInfoTypes>
+{
+	static tl::net::send_lane Of(CustomInfoTypes id)
+	{
+		switch (id)
+		{
+		case CustomInfoTypes::FILE_CHUNK:
+			return tl::net::send_lane::bulk;
+		case CustomInfoTypes::FILE_OPEN:
+			return tl::net::send_lane::interactive;
+		default:
+			return tl::net::send_lane::control;
+		}
+	}
+};
+
+static const tl::net::file_transfer_ids<CustomInfoTypes> fileTransferIDs{
+	CustomInfoTypes::FILE_OPEN, CustomInfoTypes::FILE_CHUNK, CustomInfoTypes::FILE_ACK };
+
+static const tl::net::playback_ids<CustomInfoTypes> playbackIDs{
+	CustomInfoTypes::PLAYBACK_REQUEST, CustomInfoTypes::PLAYBACK_COMMAND };
+
 
 class CustomServer : public tl::net::server_interface<CustomInfoTypes>
 {
 public:
-	CustomServer(uint16_t nPort) : tl::net::server_interface<CustomInfoTypes>(nPort)
+	CustomServer(uint16_t nPort, size_t nThreads = 1) : tl::net::server_interface<CustomInfoTypes>(nPort, nThreads),
+		m_playback(playbackIDs)
 	{
 
 	}
@@ -33,20 +66,71 @@ protected:
 	virtual void OnClientDisconnect(std::shared_ptr<tl::net::Connection<CustomInfoTypes>> client)
 	{
 		std::cout << "Removing client [" << client->GetID() << "]\n";
+		m_mapReceivers.erase(client->GetID());
 	}
 	virtual void OnInfo(std::shared_ptr<tl::net::Connection<CustomInfoTypes>> client, tl::net::info<CustomInfoTypes>& info) 
 	{
-		std::cout << "On Info\n";
 		switch (info.header.id)
 		{
 		case CustomInfoTypes::GIF:
 			std::cout << "[" << client->GetID() << "]: Server GIF Ping\n";
 
-			client->Send(info);
+			//The ping is bounced back as it is, so its body can simply be handed over
+			client->Send(std::move(info));
+			break;
+		case CustomInfoTypes::FILE_OPEN:
+		case CustomInfoTypes::FILE_CHUNK:
+			ReceiverFor(client).OnInfo(info, [&client](const tl::net::info<CustomInfoTypes>& reply) { client->Send(reply); });
 			break;
+		case CustomInfoTypes::PLAYBACK_REQUEST:
+			//Every receiver, the one that asked included, acts at the same instant of server time
+			std::cout << "[" << client->GetID() << "]: Playback request\n";
+			if (auto command = m_playback.Schedule(info, GetMaxRtt()))
+				SendInfoToAllClients(*command);
+			break;
+		default:
+			//Infos only the server sends, such as PLAYBACK_COMMAND, or ones it doesn't know
+			break;
+		}
+	}
+
+public:
+	virtual void OnClientValidated(std::shared_ptr<tl::net::Connection<CustomInfoTypes>> client)
+	{
+		//Lets the client know it may start using the connection
+		tl::net::info<CustomInfoTypes> info;
+		info.header.id = CustomInfoTypes::CONNECTION_VERIFIED;
+		client->Send(info);
+	}
+
+	//The client came back over a new connection with its old ID, so its receiver and any half received file are
+	//still in m_mapReceivers
+	virtual void OnClientResumed(std::shared_ptr<tl::net::Connection<CustomInfoTypes>> client)
+	{
+		std::cout << "[" << client->GetID() << "]: Client resumed its session\n";
+	}
+
+private:
+	//Each client streams its files into a receiver of its own
+	tl::net::file_receiver<CustomInfoTypes>& ReceiverFor(std::shared_ptr<tl::net::Connection<CustomInfoTypes>>& client)
+	{
+		auto it = m_mapReceivers.find(client->GetID());
+		if (it == m_mapReceivers.end())
+		{
+			std::filesystem::create_directories("received");
+			it = m_mapReceivers.try_emplace(client->GetID(), fileTransferIDs, "received").first;
+			it->second.OnFileReceived = [](const tl::net::file_receiver<CustomInfoTypes>::transfer& t)
+			{
+				std::cout << "Received " << t.sPath << " (" << t.nFileSize << " bytes)\n";
+			};
 		}
+		return it->second;
 	}
 
+	std::map<uint32_t, tl::net::file_receiver<CustomInfoTypes>> m_mapReceivers;
+	//The shared playback timeline of all receivers
+	tl::net::playback_scheduler<CustomInfoTypes> m_playback;
+
 
 
 
@@ -54,7 +138,11 @@ protected:
 
 int main()
 {
-	CustomServer server(60000);
+	CustomServer server(60000, std::thread::hardware_concurrency());
+	//A client that drops off the Wi-Fi has this long to come back and carry on with its cast
+	server.SetSessionGrace(std::chrono::seconds(30));
+	//Clients on the same machine hand their media over through shared memory
+	server.ListenSharedMemory("/tmp/tl_net_simple_server.sock");
 	server.Start();
 
 	while (1)
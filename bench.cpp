@@ -0,0 +1,547 @@
+/*
+	bench.cpp
+
+	Loopback benchmark for the networking library. A server_interface and a number of client_interfaces run in this
+	one process and talk over 127.0.0.1, so every send and receive takes the same path through Connection, the
+	queues and the kernel that it would between machines, and every timestamp comes from the same steady_clock.
+	With --transport local or shm they talk over an AF_UNIX socket or shared memory rings instead, to compare the
+	transports on the same host.
+
+	Three scenarios are run once per payload size, and a fourth just once:
+
+	 unicast   every client sends to the server             latency: client send -> server OnInfo
+	 fanout    the server sends to every client at once     latency: server send -> client pops it
+	           with SendInfoToAllClients
+	 echo      every client sends, the server sends it      latency: client send -> client pops the reply
+	           back, like the GIF ping in SimpleServer         (a full round trip)
+	 skew      the server schedules a play or pause for        skew: latest minus earliest time the clients
+	           every client with a playback_scheduler          act on the same command
+
+	Senders keep at most a window of infos in flight, so the latency measured is that of the library and not of an
+	ever-growing queue. The payload size is the size of the body; 8 more bytes carry the send timestamp.
+
+	Every result also has the CPU time the whole process used during the run and how often its threads were switched
+	out, and the output says which I/O backend asio was built with. To compare epoll with io_uring, run the same
+	options against a build with -Dio_uring=enabled and one without; for system call counts run both under
+	perf stat -e raw_syscalls:sys_enter.
+
+	Results are printed to stdout as JSON, everything else goes to stderr:
+
+	 bench [--clients N] [--threads N] [--port P] [--bytes B] [--window W] [--sizes 0,64,1024,...]
+	       [--modes unicast,fanout,echo,skew] [--transport tcp|local|shm]
+*/
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <sys/resource.h>
+#include <tl_net.h>
+
+enum class BenchInfoTypes : uint32_t
+{
+	unicast,
+	fanout,
+	echo_request,
+	echo_reply,
+	wake,
+	playback_request,
+	playback_command
+};
+
+static const tl::net::playback_ids<BenchInfoTypes> playbackIDs{
+	BenchInfoTypes::playback_request, BenchInfoTypes::playback_command };
+
+using bench_clock = std::chrono::steady_clock;
+
+static uint64_t NowNanoseconds()
+{
+	return uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(bench_clock::now().time_since_epoch()).count());
+}
+
+static tl::net::info<BenchInfoTypes> MakePayload(BenchInfoTypes id, size_t nBytes)
+{
+	tl::net::info<BenchInfoTypes> info = tl::net::make_info(id, nBytes + sizeof(uint64_t));
+	info.body.resize(nBytes);
+	info << NowNanoseconds();
+	return info;
+}
+
+static uint64_t SentAt(tl::net::info<BenchInfoTypes>& info)
+{
+	uint64_t nSentAt = 0;
+	info >> nSentAt;
+	return nSentAt;
+}
+
+struct bench_options
+{
+	size_t nClients = 4;
+	size_t nThreads = 2;
+	uint16_t nPort = 60500;
+	//Roughly how many payload bytes each scenario moves per size, which sets how many infos are sent
+	size_t nBudgetBytes = 256 * 1024 * 1024;
+	size_t nWindow = 32;
+	std::vector<size_t> vSizes = { 0, 64, 1024, 16 * 1024, 256 * 1024, 1024 * 1024, 4 * 1024 * 1024 };
+	std::vector<std::string> vModes = { "unicast", "fanout", "echo", "skew" };
+	//tcp, local or shm
+	std::string sTransport = "tcp";
+	std::string sLocalPath = "/tmp/tl_net_bench.sock";
+};
+
+class BenchServer : public tl::net::server_interface<BenchInfoTypes>
+{
+public:
+	BenchServer(uint16_t nPort, size_t nThreads) : tl::net::server_interface<BenchInfoTypes>(nPort, nThreads)
+	{
+		//The benchmark must not lose infos, and senders keep their own window, so producers just wait if they
+		//ever get that far ahead
+		tl::net::send_watermarks watermarks;
+		watermarks.nHighBytes = watermarks.nLowBytes = size_t(1) << 40;
+		watermarks.nHighInfos = watermarks.nLowInfos = size_t(1) << 40;
+		SetBackpressure(watermarks, tl::net::backpressure_policy::block);
+	}
+
+	void OnClientValidated(std::shared_ptr<tl::net::Connection<BenchInfoTypes>> client) override
+	{
+		m_nValidated++;
+	}
+
+	//Only touched by the thread calling Update()
+	tl::net::histogram m_histLatency;
+	std::atomic<uint64_t> m_nReceived{ 0 };
+	std::atomic<size_t> m_nValidated{ 0 };
+
+protected:
+	bool OnClientConnect(std::shared_ptr<tl::net::Connection<BenchInfoTypes>> client) override
+	{
+		return true;
+	}
+
+	void OnInfo(std::shared_ptr<tl::net::Connection<BenchInfoTypes>> client, tl::net::info<BenchInfoTypes>& info) override
+	{
+		switch (info.header.id)
+		{
+		case BenchInfoTypes::unicast:
+			m_histLatency.Record(NowNanoseconds() - SentAt(info));
+			m_nReceived.fetch_add(1, std::memory_order_release);
+			break;
+
+		case BenchInfoTypes::echo_request:
+			info.header.id = BenchInfoTypes::echo_reply;
+			client->Send(std::move(info));
+			break;
+
+		default:
+			break;
+		}
+	}
+};
+
+class BenchClient : public tl::net::client_interface<BenchInfoTypes, int>
+{
+public:
+	//Drains the inbound queue on its own thread until bStop is set and a wake info arrives
+	void Receive(const std::atomic<bool>& bStop)
+	{
+		while (!bStop.load(std::memory_order_acquire))
+		{
+			Incoming().wait();
+			while (!Incoming().empty())
+			{
+				auto owned = Incoming().pop_front();
+				switch (owned.info_.header.id)
+				{
+				case BenchInfoTypes::fanout:
+				case BenchInfoTypes::echo_reply:
+					m_histLatency.Record(NowNanoseconds() - SentAt(owned.info_));
+					m_nReceived.fetch_add(1, std::memory_order_release);
+					break;
+
+				case BenchInfoTypes::playback_command:
+					{
+						tl::net::playback_command command;
+						if (!tl::net::ReadPlaybackCommand(owned.info_, command))
+							break;
+						//Note when the command was acted on, on the server's clock
+						RunAtServerTime(command.nServerTime, [this]()
+							{
+								m_nActedAt.store(ServerNow(), std::memory_order_relaxed);
+								m_nActed.fetch_add(1, std::memory_order_release);
+							});
+					}
+					break;
+
+				default:
+					break;
+				}
+			}
+		}
+	}
+
+	//Only touched by this client's receive thread, and read once it has stopped
+	tl::net::histogram m_histLatency;
+	std::atomic<uint64_t> m_nReceived{ 0 };
+	//Server time the last playback command was acted on, and how many have been
+	std::atomic<uint64_t> m_nActedAt{ 0 };
+	std::atomic<uint64_t> m_nActed{ 0 };
+};
+
+struct bench_result
+{
+	std::string sMode;
+	size_t nPayloadBytes = 0;
+	uint64_t nInfos = 0;
+	double dSeconds = 0.0;
+	tl::net::histogram_snapshot latency;
+	bool bTimedOut = false;
+	//User plus system time of the whole process, and voluntary plus involuntary context switches
+	double dCpuSeconds = 0.0;
+	uint64_t nContextSwitches = 0;
+
+	std::string ToJson() const
+	{
+		double dRate = dSeconds > 0 ? double(nInfos) / dSeconds : 0.0;
+		std::ostringstream os;
+		os << "{\"mode\":\"" << sMode << "\",\"payload_bytes\":" << nPayloadBytes << ",\"infos\":" << nInfos
+			<< ",\"seconds\":" << dSeconds << ",\"infos_per_sec\":" << uint64_t(dRate)
+			<< ",\"mb_per_sec\":" << dRate * double(nPayloadBytes) / 1e6
+			<< ",\"latency_ns\":{\"p50\":" << latency.ValueAt(0.5) << ",\"p99\":" << latency.ValueAt(0.99)
+			<< ",\"p999\":" << latency.ValueAt(0.999) << ",\"max\":" << latency.nMax
+			<< ",\"mean\":" << uint64_t(latency.Mean()) << "}"
+			<< ",\"cpu_seconds\":" << dCpuSeconds
+			<< ",\"cpu_ns_per_info\":" << (nInfos ? uint64_t(dCpuSeconds * 1e9 / double(nInfos)) : 0)
+			<< ",\"context_switches\":" << nContextSwitches
+			<< ",\"timed_out\":" << (bTimedOut ? "true" : "false") << "}";
+		return os.str();
+	}
+};
+
+//Waits until fnDone() is true, or gives up after a minute
+template<typename Done>
+static bool WaitFor(Done&& fnDone)
+{
+	auto tGiveUp = bench_clock::now() + std::chrono::seconds(60);
+	while (!fnDone())
+	{
+		if (bench_clock::now() > tGiveUp)
+			return false;
+		std::this_thread::yield();
+	}
+	return true;
+}
+
+class Bench
+{
+public:
+	explicit Bench(const bench_options& options) : m_options(options), m_server(options.nPort, options.nThreads)
+	{
+	}
+
+	bool Start()
+	{
+		tl::net::logger::SetOutput(std::cerr);
+		tl::net::logger::SetLevel(tl::net::log_level::warn);
+
+		if (m_options.sTransport == "local" && !m_server.ListenLocal(m_options.sLocalPath))
+			return false;
+		if (m_options.sTransport == "shm" && !m_server.ListenSharedMemory(m_options.sLocalPath))
+			return false;
+		if (!m_server.Start())
+			return false;
+		m_thrServer = std::thread([this]()
+			{
+				while (!m_bStop.load(std::memory_order_acquire))
+					m_server.Update(-1, true);
+			});
+
+		for (size_t i = 0; i < m_options.nClients; i++)
+		{
+			m_vClients.push_back(std::make_unique<BenchClient>());
+			BenchClient& client = *m_vClients.back();
+			bool bConnected = m_options.sTransport == "local" ? client.ConnectLocal(m_options.sLocalPath)
+				: m_options.sTransport == "shm" ? client.ConnectSharedMemory(m_options.sLocalPath)
+				: client.Connect("127.0.0.1", m_options.nPort);
+			if (!bConnected)
+				return false;
+		}
+
+		if (!WaitFor([this] { return m_server.m_nValidated.load() == m_options.nClients; }))
+			return false;
+
+		for (auto& pClient : m_vClients)
+			m_vReceivers.emplace_back([this, pClient = pClient.get()]() { pClient->Receive(m_bStop); });
+		return true;
+	}
+
+	void Stop()
+	{
+		m_bStop.store(true, std::memory_order_release);
+
+		//Both sides may be asleep in wait(), so give each of them one more info to wake up to
+		m_server.SendInfoToAllClients(MakePayload(BenchInfoTypes::wake, 0));
+		m_vClients.front()->Send(MakePayload(BenchInfoTypes::wake, 0));
+
+		for (auto& thr : m_vReceivers)
+			thr.join();
+		m_thrServer.join();
+
+		m_vClients.clear();
+		m_server.Stop();
+	}
+
+	bench_result Run(const std::string& sMode, size_t nPayloadBytes)
+	{
+		bench_result result;
+		result.sMode = sMode;
+		result.nPayloadBytes = nPayloadBytes;
+
+		size_t nClients = m_vClients.size();
+		size_t nPerSender = std::clamp<size_t>(m_options.nBudgetBytes / std::max<size_t>(nPayloadBytes, 64) / nClients, 20, 20000);
+		//Big payloads get a smaller window so that at most about 64 MiB is in flight per sender
+		uint64_t nWindow = std::clamp<size_t>((64 * 1024 * 1024) / std::max<size_t>(nPayloadBytes, 1), 2, m_options.nWindow);
+
+		rusage usageStart{};
+		getrusage(RUSAGE_SELF, &usageStart);
+		auto tStart = bench_clock::now();
+
+		if (sMode == "unicast")
+		{
+			uint64_t nBase = m_server.m_nReceived.load();
+			std::atomic<uint64_t> nSent{ 0 };
+			RunSenders(nPerSender, [&](BenchClient& client, size_t i)
+				{
+					WaitFor([&] { return nSent.load() - (m_server.m_nReceived.load(std::memory_order_acquire) - nBase) < nWindow * nClients; });
+					nSent.fetch_add(1);
+					client.Send(MakePayload(BenchInfoTypes::unicast, nPayloadBytes));
+				});
+			result.nInfos = nPerSender * nClients;
+			result.bTimedOut = !WaitFor([&] { return m_server.m_nReceived.load() - nBase == result.nInfos; });
+		}
+		else if (sMode == "fanout")
+		{
+			uint64_t nBase = ClientsReceived();
+			for (size_t i = 0; i < nPerSender && !result.bTimedOut; i++)
+			{
+				result.bTimedOut = !WaitFor([&] { return i * nClients - (ClientsReceived() - nBase) < nWindow * nClients; });
+				m_server.SendInfoToAllClients(MakePayload(BenchInfoTypes::fanout, nPayloadBytes));
+			}
+			result.nInfos = nPerSender * nClients;
+			result.bTimedOut |= !WaitFor([&] { return ClientsReceived() - nBase == result.nInfos; });
+		}
+		else if (sMode == "echo")
+		{
+			uint64_t nBase = ClientsReceived();
+			std::vector<uint64_t> vBase;
+			for (auto& pClient : m_vClients)
+				vBase.push_back(pClient->m_nReceived.load());
+
+			RunSenders(nPerSender, [&](BenchClient& client, size_t i)
+				{
+					uint64_t nMine = vBase[IndexOf(client)];
+					WaitFor([&] { return i - (client.m_nReceived.load(std::memory_order_acquire) - nMine) < nWindow; });
+					client.Send(MakePayload(BenchInfoTypes::echo_request, nPayloadBytes));
+				});
+			result.nInfos = nPerSender * nClients;
+			result.bTimedOut = !WaitFor([&] { return ClientsReceived() - nBase == result.nInfos; });
+		}
+		else if (sMode == "skew")
+		{
+			//One command at a time, each scheduled a short way ahead like a real play or pause would be
+			const size_t nCommands = 50;
+			result.bTimedOut = !WaitFor([&]
+				{
+					return std::all_of(m_vClients.begin(), m_vClients.end(), [](auto& pClient) { return pClient->IsClockSynced(); });
+				});
+
+			tl::net::playback_scheduler<BenchInfoTypes> scheduler(playbackIDs, std::chrono::milliseconds(20));
+			for (size_t i = 0; i < nCommands && !result.bTimedOut; i++)
+			{
+				std::vector<uint64_t> vBase;
+				for (auto& pClient : m_vClients)
+					vBase.push_back(pClient->m_nActed.load());
+
+				auto action = i % 2 ? tl::net::playback_action::pause : tl::net::playback_action::play;
+				m_server.SendInfoToAllClients(*scheduler.Schedule(
+					tl::net::MakePlaybackRequest(playbackIDs, action), m_server.GetMaxRtt()));
+
+				result.bTimedOut = !WaitFor([&]
+					{
+						for (size_t c = 0; c < nClients; c++)
+							if (m_vClients[c]->m_nActed.load(std::memory_order_acquire) == vBase[c])
+								return false;
+						return true;
+					});
+
+				uint64_t nFirst = UINT64_MAX, nLast = 0;
+				for (auto& pClient : m_vClients)
+				{
+					uint64_t nActedAt = pClient->m_nActedAt.load(std::memory_order_relaxed);
+					nFirst = std::min(nFirst, nActedAt);
+					nLast = std::max(nLast, nActedAt);
+				}
+				m_histSkew.Record(nLast - nFirst);
+			}
+			result.nPayloadBytes = sizeof(tl::net::playback_command);
+			result.nInfos = nCommands * nClients;
+		}
+
+		result.dSeconds = std::chrono::duration<double>(bench_clock::now() - tStart).count();
+		rusage usageEnd{};
+		getrusage(RUSAGE_SELF, &usageEnd);
+		result.dCpuSeconds = Seconds(usageEnd.ru_utime) + Seconds(usageEnd.ru_stime)
+			- Seconds(usageStart.ru_utime) - Seconds(usageStart.ru_stime);
+		result.nContextSwitches = uint64_t(usageEnd.ru_nvcsw + usageEnd.ru_nivcsw - usageStart.ru_nvcsw - usageStart.ru_nivcsw);
+		return result;
+	}
+
+	static double Seconds(const timeval& tv)
+	{
+		return double(tv.tv_sec) + double(tv.tv_usec) / 1e6;
+	}
+
+	//Latency recorded since the last call, across the server and every client
+	tl::net::histogram_snapshot TakeLatency()
+	{
+		tl::net::histogram_snapshot total = m_server.m_histLatency.Snapshot();
+		for (auto& pClient : m_vClients)
+			total.Merge(pClient->m_histLatency.Snapshot());
+		total.Merge(m_histSkew.Snapshot());
+
+		tl::net::histogram_snapshot delta = total;
+		for (size_t i = 0; i < delta.vCounts.size(); i++)
+			delta.vCounts[i] -= m_latencySeen.vCounts[i];
+		delta.nCount -= m_latencySeen.nCount;
+		delta.nSum -= m_latencySeen.nSum;
+		m_latencySeen = total;
+
+		//The running maximum covers every earlier run too, so take the top of the highest bucket used by this one
+		delta.nMax = 0;
+		for (size_t i = delta.vCounts.size(); i-- > 0;)
+			if (delta.vCounts[i])
+			{
+				delta.nMax = tl::net::histogram_snapshot::LowestOf(i + 1) - 1;
+				break;
+			}
+		return delta;
+	}
+
+protected:
+	size_t IndexOf(const BenchClient& client) const
+	{
+		for (size_t i = 0; i < m_vClients.size(); i++)
+			if (m_vClients[i].get() == &client)
+				return i;
+		return 0;
+	}
+
+	uint64_t ClientsReceived()
+	{
+		uint64_t n = 0;
+		for (auto& pClient : m_vClients)
+			n += pClient->m_nReceived.load(std::memory_order_acquire);
+		return n;
+	}
+
+	//Runs fnSend(client, i) for i from 0 to nCount for every client, each client on its own thread
+	template<typename Send>
+	void RunSenders(size_t nCount, Send&& fnSend)
+	{
+		std::vector<std::thread> vSenders;
+		for (auto& pClient : m_vClients)
+			vSenders.emplace_back([&, pClient = pClient.get()]()
+				{
+					for (size_t i = 0; i < nCount; i++)
+						fnSend(*pClient, i);
+				});
+		for (auto& thr : vSenders)
+			thr.join();
+	}
+
+	bench_options m_options;
+	BenchServer m_server;
+	std::vector<std::unique_ptr<BenchClient>> m_vClients;
+	std::vector<std::thread> m_vReceivers;
+	std::thread m_thrServer;
+	std::atomic<bool> m_bStop{ false };
+	tl::net::histogram_snapshot m_latencySeen;
+	//Only touched by the thread calling Run()
+	tl::net::histogram m_histSkew;
+};
+
+//The way asio waits for sockets in this build, set by the io_uring meson option
+static const char* IoBackend()
+{
+#if defined(ASIO_HAS_IO_URING) && defined(ASIO_DISABLE_EPOLL)
+	return "io_uring";
+#elif defined(ASIO_HAS_IO_URING)
+	return "epoll, io_uring for files";
+#else
+	return "epoll";
+#endif
+}
+
+template<typename V, typename Parse>
+static std::vector<V> SplitList(const std::string& s, Parse&& fnParse)
+{
+	std::vector<V> v;
+	std::stringstream ss(s);
+	std::string sItem;
+	while (std::getline(ss, sItem, ','))
+		if (!sItem.empty())
+			v.push_back(fnParse(sItem));
+	return v;
+}
+
+int main(int argc, char** argv)
+{
+	bench_options options;
+	for (int i = 1; i + 1 < argc; i += 2)
+	{
+		std::string sFlag = argv[i];
+		std::string sValue = argv[i + 1];
+		if (sFlag == "--clients") options.nClients = std::max<size_t>(1, std::stoul(sValue));
+		else if (sFlag == "--threads") options.nThreads = std::stoul(sValue);
+		else if (sFlag == "--port") options.nPort = uint16_t(std::stoul(sValue));
+		else if (sFlag == "--bytes") options.nBudgetBytes = std::stoull(sValue);
+		else if (sFlag == "--window") options.nWindow = std::max<size_t>(1, std::stoul(sValue));
+		else if (sFlag == "--sizes") options.vSizes = SplitList<size_t>(sValue, [](const std::string& s) { return size_t(std::stoull(s)); });
+		else if (sFlag == "--modes") options.vModes = SplitList<std::string>(sValue, [](const std::string& s) { return s; });
+		else if (sFlag == "--transport" && (sValue == "tcp" || sValue == "local" || sValue == "shm")) options.sTransport = sValue;
+		else
+		{
+			std::cerr << "Unknown option " << sFlag << "\n";
+			return 2;
+		}
+	}
+
+	Bench bench(options);
+	if (!bench.Start())
+	{
+		std::cerr << "Failed to start the benchmark\n";
+		return 1;
+	}
+
+	std::vector<bench_result> vResults;
+	for (const std::string& sMode : options.vModes)
+		for (size_t nSize : options.vSizes)
+		{
+			//Skew doesn't depend on the payload size, so it only runs once
+			if (sMode == "skew" && nSize != options.vSizes.front())
+				continue;
+
+			bench.TakeLatency();
+			bench_result result = bench.Run(sMode, nSize);
+			result.latency = bench.TakeLatency();
+			std::cerr << sMode << " " << nSize << " B: " << result.nInfos << " infos in " << result.dSeconds << " s\n";
+			vResults.push_back(result);
+		}
+
+	bench.Stop();
+
+	std::cout << "{\"clients\":" << options.nClients << ",\"threads\":" << options.nThreads
+		<< ",\"transport\":\"" << options.sTransport << "\",\"backend\":\"" << IoBackend() << "\",\"results\":[";
+	for (size_t i = 0; i < vResults.size(); i++)
+		std::cout << (i ? "," : "") << "\n  " << vResults[i].ToJson();
+	std::cout << "\n]}\n";
+	return 0;
+}
@@ -4,6 +4,8 @@
 #include<memory>
 #include<thread>
 #include<mutex>
+#include<atomic>
+#include<array>
 #include<deque>
 #include<optional>
 #include<vector>
@@ -11,13 +13,31 @@
 #include<algorithm>
 #include<chrono>
 #include<cstdint>
+#include<limits>
 #include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <sys/sendfile.h>
+#endif
 
 #define ASIO_STANDALONE
 #include<asio.hpp>
 #include<asio/ts/buffer.hpp>
 #include<asio/ts/internet.hpp>
 
+namespace tl
+{
+	namespace net
+	{
+		//steady_clock time in nanoseconds, for timestamps that only ever get compared within this process
+		inline uint64_t SteadyNanoseconds()
+		{
+			return uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(
+				std::chrono::steady_clock::now().time_since_epoch()).count());
+		}
+	}
+}
 
 
 
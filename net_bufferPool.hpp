@@ -0,0 +1,318 @@
+#ifndef NET_BUFFERPOOL_HPP
+#define NET_BUFFERPOOL_HPP
+/*
+	net_bufferPool.hpp
+
+	Every info that arrives needs a body, and every body used to be a fresh trip to malloc followed later by a trip to
+	free, usually on a different thread. While streaming, the same few sizes come up over and over again, so instead
+	of giving the memory back we keep it in pools sorted by size and hand it out again.
+
+	 size class:   64 B   128 B   256 B   ...   1 MiB   2 MiB   4 MiB
+	              |-----| |-----| |-----|       |-----| |-----| |-----|
+	 thread cache | | | | | | | | | | | |  ...  | | | | | | | | | | | |   one per thread, no locking at all
+	              |-----| |-----| |-----|       |-----| |-----| |-----|
+	                 ^ v     ^ v     ^ v           ^ v     ^ v     ^ v     blocks move in batches
+	              |-----| |-----| |-----|       |-----| |-----| |-----|
+	 central pool | | | | | | | | | | | |  ...  | | | | | | | | | | | |   shared, one mutex per size class
+	              |-----| |-----| |-----|       |-----| |-----| |-----|
+
+	An io thread allocates the body of every info it reads, and the thread calling Update() frees it once OnInfo has
+	returned. The freed block lands in the consumer's thread cache, overflows in a batch to the central pool, and is
+	picked up again in a batch by the io thread when its own cache runs dry. Once that cycle is warm, streaming does
+	no mallocs per info.
+
+	Requests are rounded up to a power of two, so a block wastes at most half of itself. Anything larger than the
+	biggest class goes straight to operator new.
+*/
+
+#include "net_base.h"
+
+namespace tl
+{
+	namespace net
+	{
+		class buffer_pool
+		{
+			public:
+				static constexpr size_t nMinClassShift = 6;		// 64 B
+				static constexpr size_t nMaxClassShift = 22;	// 4 MiB
+				static constexpr size_t nClasses = nMaxClassShift - nMinClassShift + 1;
+
+				//How many bytes of each size class a thread keeps to itself, and how many the central pool keeps for
+				//everyone. Each holds at least a few blocks even of the largest class.
+				static constexpr size_t nThreadCacheBytes = 1024 * 1024;
+				static constexpr size_t nCentralBytes = 16 * 1024 * 1024;
+
+				struct stats
+				{
+					//Allocations served from a thread cache or the central pool
+					uint64_t nHits = 0;
+					//Allocations of a pooled size that had to go to operator new
+					uint64_t nMisses = 0;
+					//Allocations too large for any size class
+					uint64_t nOversize = 0;
+
+					double HitRate() const
+					{
+						uint64_t nTotal = nHits + nMisses;
+						return nTotal ? double(nHits) / double(nTotal) : 0.0;
+					}
+				};
+
+				static void* allocate(size_t nBytes)
+				{
+					size_t nClass = ClassOf(nBytes);
+					thread_cache& cache = Cache();
+
+					if (nClass >= nClasses)
+					{
+						cache.nOversize.fetch_add(1, std::memory_order_relaxed);
+						return ::operator new(nBytes);
+					}
+
+					std::vector<void*>& vFree = cache.vFree[nClass];
+					if (vFree.empty())
+						Central().Refill(nClass, vFree, BatchSize(nClass));
+
+					if (vFree.empty())
+					{
+						cache.nMisses.fetch_add(1, std::memory_order_relaxed);
+						return ::operator new(ClassBytes(nClass));
+					}
+
+					cache.nHits.fetch_add(1, std::memory_order_relaxed);
+					void* p = vFree.back();
+					vFree.pop_back();
+					return p;
+				}
+
+				static void deallocate(void* p, size_t nBytes)
+				{
+					size_t nClass = ClassOf(nBytes);
+					if (nClass >= nClasses)
+					{
+						::operator delete(p);
+						return;
+					}
+
+					std::vector<void*>& vFree = Cache().vFree[nClass];
+					vFree.push_back(p);
+
+					//Keep the thread cache bounded by handing half of it back to the central pool
+					if (vFree.size() > 2 * BatchSize(nClass))
+						Central().Release(nClass, vFree, BatchSize(nClass));
+				}
+
+				//Sums the counters of every thread that has ever used the pool
+				static stats GetStats()
+				{
+					return Central().GetStats();
+				}
+
+			protected:
+				//Counters are only ever written by their own thread, so relaxed atomics cost no more than plain
+				//integers. They are atomic so that GetStats() can read them from another thread.
+				struct thread_cache
+				{
+					std::array<std::vector<void*>, nClasses> vFree;
+					std::atomic<uint64_t> nHits{ 0 };
+					std::atomic<uint64_t> nMisses{ 0 };
+					std::atomic<uint64_t> nOversize{ 0 };
+
+					thread_cache()
+					{
+						Central().Register(this);
+					}
+
+					~thread_cache()
+					{
+						Central().Unregister(this);
+					}
+				};
+
+				class central_pool
+				{
+					public:
+						~central_pool()
+						{
+							for (auto& vFree : m_vFree)
+								for (void* p : vFree)
+									::operator delete(p);
+						}
+
+						void Refill(size_t nClass, std::vector<void*>& vOut, size_t nMax)
+						{
+							std::scoped_lock lock(m_muxClass[nClass]);
+							std::vector<void*>& vFree = m_vFree[nClass];
+							size_t n = std::min(nMax, vFree.size());
+							vOut.insert(vOut.end(), vFree.end() - n, vFree.end());
+							vFree.resize(vFree.size() - n);
+						}
+
+						void Release(size_t nClass, std::vector<void*>& vIn, size_t nCount)
+						{
+							size_t nKeep = std::max<size_t>(4, nCentralBytes / ClassBytes(nClass));
+							std::scoped_lock lock(m_muxClass[nClass]);
+							std::vector<void*>& vFree = m_vFree[nClass];
+
+							for (size_t i = 0; i < nCount && !vIn.empty(); i++)
+							{
+								if (vFree.size() < nKeep)
+									vFree.push_back(vIn.back());
+								else
+									::operator delete(vIn.back());
+								vIn.pop_back();
+							}
+						}
+
+						void Register(thread_cache* pCache)
+						{
+							std::scoped_lock lock(m_muxCaches);
+							m_vCaches.push_back(pCache);
+						}
+
+						//A thread is going away. Its blocks go to the central pool and its counters are kept.
+						void Unregister(thread_cache* pCache)
+						{
+							for (size_t nClass = 0; nClass < nClasses; nClass++)
+								Release(nClass, pCache->vFree[nClass], pCache->vFree[nClass].size());
+
+							std::scoped_lock lock(m_muxCaches);
+							m_statsRetired.nHits += pCache->nHits.load(std::memory_order_relaxed);
+							m_statsRetired.nMisses += pCache->nMisses.load(std::memory_order_relaxed);
+							m_statsRetired.nOversize += pCache->nOversize.load(std::memory_order_relaxed);
+							m_vCaches.erase(std::remove(m_vCaches.begin(), m_vCaches.end(), pCache), m_vCaches.end());
+						}
+
+						stats GetStats()
+						{
+							std::scoped_lock lock(m_muxCaches);
+							stats s = m_statsRetired;
+							for (thread_cache* pCache : m_vCaches)
+							{
+								s.nHits += pCache->nHits.load(std::memory_order_relaxed);
+								s.nMisses += pCache->nMisses.load(std::memory_order_relaxed);
+								s.nOversize += pCache->nOversize.load(std::memory_order_relaxed);
+							}
+							return s;
+						}
+
+					private:
+						std::array<std::mutex, nClasses> m_muxClass;
+						std::array<std::vector<void*>, nClasses> m_vFree;
+
+						std::mutex m_muxCaches;
+						std::vector<thread_cache*> m_vCaches;
+						stats m_statsRetired;
+				};
+
+				static central_pool& Central()
+				{
+					static central_pool central;
+					return central;
+				}
+
+				static thread_cache& Cache()
+				{
+					thread_local thread_cache cache;
+					return cache;
+				}
+
+				static size_t ClassOf(size_t nBytes)
+				{
+					size_t nShift = nMinClassShift;
+					while ((size_t(1) << nShift) < nBytes && nShift <= nMaxClassShift)
+						nShift++;
+					return nShift - nMinClassShift;
+				}
+
+				static size_t ClassBytes(size_t nClass)
+				{
+					return size_t(1) << (nClass + nMinClassShift);
+				}
+
+				static size_t BatchSize(size_t nClass)
+				{
+					return std::max<size_t>(2, nThreadCacheBytes / ClassBytes(nClass) / 2);
+				}
+		};
+
+		//Allocator that draws from buffer_pool, for use with standard containers.
+		//Elements are value-initialised as with std::allocator, so a resized body is zeroed and never carries what an
+		//earlier owner of the pooled memory left in it. See resize_uninitialized() for the exception.
+		template<typename U>
+		class pool_allocator
+		{
+			public:
+				using value_type = U;
+
+				pool_allocator() = default;
+
+				template<typename V>
+				pool_allocator(const pool_allocator<V>&) noexcept
+				{
+				}
+
+				U* allocate(size_t n)
+				{
+					return static_cast<U*>(buffer_pool::allocate(n * sizeof(U)));
+				}
+
+				void deallocate(U* p, size_t n) noexcept
+				{
+					buffer_pool::deallocate(p, n * sizeof(U));
+				}
+
+				template<typename V>
+				void construct(V* p) noexcept(std::is_nothrow_default_constructible<V>::value)
+				{
+					if (SkipInit())
+						::new (static_cast<void*>(p)) V;
+					else
+						::new (static_cast<void*>(p)) V();
+				}
+
+				template<typename V, typename... Args>
+				void construct(V* p, Args&&... args)
+				{
+					::new (static_cast<void*>(p)) V(std::forward<Args>(args)...);
+				}
+
+				template<typename V>
+				bool operator==(const pool_allocator<V>&) const noexcept
+				{
+					return true;
+				}
+
+				template<typename V>
+				bool operator!=(const pool_allocator<V>&) const noexcept
+				{
+					return false;
+				}
+
+				//Set by resize_uninitialized() while it resizes on this thread
+				static bool& SkipInit() noexcept
+				{
+					thread_local bool bSkip = false;
+					return bSkip;
+				}
+		};
+
+		//Resizes v without initialising the elements it adds, which then hold whatever the pool's memory last held,
+		//possibly another connection's data. Only for buffers that are overwritten in full straight away, such as
+		//one a socket or file read is about to fill.
+		template<typename U>
+		void resize_uninitialized(std::vector<U, pool_allocator<U>>& v, size_t n)
+		{
+			struct skip_init
+			{
+				skip_init() { pool_allocator<U>::SkipInit() = true; }
+				~skip_init() { pool_allocator<U>::SkipInit() = false; }
+			} skip;
+
+			v.resize(n);
+		}
+	}
+}
+
+#endif
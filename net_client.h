@@ -5,6 +5,7 @@
 #include "net_info.h"
 #include "net_threadsafeQueue.hpp"
 #include "net_connection.h"
+#include "net_log.hpp"
 #include "user_command.h"
 
 namespace tl
@@ -26,7 +27,8 @@ namespace tl
 			}*/
 			client_interface()
 			{
-
+				m_qInfosIn.set_notify(&m_ready);
+				m_nUserCommands.set_notify(&m_ready);
 			}
 			virtual ~client_interface()
 			{
@@ -34,9 +36,14 @@ namespace tl
 				//server
 				Disconnect();
 			}
-			// Connect to server with hostname/ip-address and port
-			bool Connect(const std::string& host, const uint16_t port)
+			// Connect to server with hostname/ip-address and port. With a valid session token the connection asks to
+			// resume that session first, see Reconnect().
+			bool Connect(const std::string& host, const uint16_t port, const session_token& resume = {})
 			{
+				m_nTransport = transport_kind::tcp;
+				m_sHost = host;
+				m_nPort = port;
+
 				try
 				{
 					//Resolve hostname/ip-address into tangible physical
@@ -44,20 +51,63 @@ namespace tl
 					asio::ip::tcp::resolver resolver(m_context);
 					asio::ip::tcp::resolver::results_type endpoints = resolver.resolve(host, std::to_string(port));
 
-					//Create connection
-					m_connection = std::make_unique<Connection<T>>(Connection<T>::owner::client, m_context, asio::ip::tcp::socket(m_context), m_qInfosIn);
+					//Create connection and tell it to connect to server
+					MakeConnection(asio::ip::tcp::socket(m_context), resume);
+					m_connection->ConnectToServer(endpoints);
+					StartContext();
+				}
+				catch (std::exception& e)
+				{
+					TL_NET_LOG_ERROR(client, "Client Exception: {}", e.what());
+					return false;
+				}
+				return true;
+			}
 
-					
+			//Connect to a server on the same host that called ListenLocal(sPath). The same infos and handshake as
+			//Connect(), over an AF_UNIX socket instead of TCP.
+			bool ConnectLocal(const std::string& sPath, const session_token& resume = {})
+			{
+				m_nTransport = transport_kind::local;
+				m_sLocalPath = sPath;
 
-					//Tell the connection object to connect to server
-					m_connection->ConnectToServer(endpoints);
+				try
+				{
+					MakeConnection(asio::local::stream_protocol::socket(m_context), resume);
+					m_connection->ConnectToServer(asio::generic::stream_protocol::endpoint(asio::local::stream_protocol::endpoint(sPath)));
+					StartContext();
+				}
+				catch (std::exception& e)
+				{
+					TL_NET_LOG_ERROR(client, "Client Exception: {}", e.what());
+					return false;
+				}
+				return true;
+			}
 
-					// Start context thread
-					thrContext = std::thread([this]() {m_context.run(); });
+			//Connect to a server on the same host that called ListenSharedMemory(sPath). Infos go through two rings of
+			//nRingBytes each in memory shared with the server, see net_transport.hpp. An info larger than a ring
+			//still goes through, a piece at a time.
+			bool ConnectSharedMemory(const std::string& sPath, const session_token& resume = {},
+				size_t nRingBytes = nDefaultRingBytes)
+			{
+				m_nTransport = transport_kind::shared_memory;
+				m_sLocalPath = sPath;
+				m_nRingBytes = nRingBytes;
+
+				try
+				{
+					//Connecting an AF_UNIX socket completes straight away, the rings are handed over on it at once
+					asio::local::stream_protocol::socket socket(m_context);
+					socket.connect(asio::local::stream_protocol::endpoint(sPath));
+
+					MakeConnection(transport_stream(shm_channel::Create(stream_socket(std::move(socket)), nRingBytes)), resume);
+					m_connection->ConnectToServer();
+					StartContext();
 				}
 				catch (std::exception& e)
 				{
-					std::cerr << "Client Exception: " << e.what() << std::endl;
+					TL_NET_LOG_ERROR(client, "Client Exception: {}", e.what());
 					return false;
 				}
 				return true;
@@ -72,13 +122,55 @@ namespace tl
 					m_connection->Disconnect();
 
 				//We are also done with the ASIO context and its thread
+				m_work.reset();
 				m_context.stop();
 
 				if (thrContext.joinable())
 					thrContext.join();
 
-				//Destroy the connection object by releasing the unique pointer
-				m_connection.release();
+				//Destroy the connection object while the context its socket belongs to is still alive
+				m_connection.reset();
+			}
+
+			//Connects again to the server last connected to, the same way, and, if it gave us a session, asks to resume it. The
+			//server then gives back the same ID and keeps whatever it held for us, such as a half received file.
+			//If the session has expired the client is validated as a new one. Called from the thread that calls
+			//Send(), typically once IsConnected() has gone false.
+			bool Reconnect()
+			{
+				session_token token = GetSession();
+				if (m_connection)
+				{
+					//Every handler of the old connection holds a reference to it, so letting go of ours frees it once
+					//the io thread has run the handlers its close aborts
+					m_connection->Disconnect();
+					m_connection.reset();
+				}
+
+				m_lastSession = token;
+				switch (m_nTransport)
+				{
+				case transport_kind::local:
+					return ConnectLocal(m_sLocalPath, token);
+				case transport_kind::shared_memory:
+					return ConnectSharedMemory(m_sLocalPath, token, m_nRingBytes);
+				default:
+					return Connect(m_sHost, m_nPort, token);
+				}
+			}
+
+			//The session the server gave this client, or the one last presented to it while it is reconnecting.
+			//Invalid if the server doesn't keep sessions.
+			session_token GetSession() const
+			{
+				session_token token = m_connection ? m_connection->GetSessionToken() : session_token{};
+				return token.IsValid() ? token : m_lastSession;
+			}
+
+			//True if the current connection took over an earlier session rather than starting a new one
+			bool IsResumed() const
+			{
+				return m_connection && m_connection->IsResumed();
 			}
 
 			// Check if client has a valid, open, and currently active connection
@@ -91,8 +183,65 @@ namespace tl
 					return false;
 			}
 			
+			//Sets how often heartbeats are sent and when a silent server is given up on. Call it before Connect().
+			void SetHeartbeat(const heartbeat_settings& settings)
+			{
+				m_heartbeat = settings;
+			}
+
+			//Sets the handshake and stalled write deadlines. Call it before Connect().
+			void SetTimeouts(const timeout_settings& settings)
+			{
+				m_timeouts = settings;
+			}
+
+			//Smoothed round trip time to the server, measured with heartbeats. Zero until the first one is back.
+			std::chrono::nanoseconds GetRtt() const
+			{
+				return m_connection ? m_connection->GetRtt() : std::chrono::nanoseconds(0);
+			}
+
+			std::chrono::nanoseconds GetRttJitter() const
+			{
+				return m_connection ? m_connection->GetRttJitter() : std::chrono::nanoseconds(0);
+			}
+
+			//True once the server's clock is known, which is one round trip after the connection is verified
+			bool IsClockSynced() const
+			{
+				return m_connection && m_connection->IsClockSynced();
+			}
+
+			//The server's steady_clock now, in nanoseconds, as estimated from heartbeats
+			uint64_t ServerNow() const
+			{
+				return m_connection ? m_connection->ToRemoteTime(SteadyNanoseconds()) : SteadyNanoseconds();
+			}
+
+			//When a time on the server's clock comes round on this side's steady_clock
+			uint64_t ToLocalTime(uint64_t nServerTime) const
+			{
+				return m_connection ? m_connection->ToLocalTime(nServerTime) : nServerTime;
+			}
+
+			//Runs fn on the client's io thread when the server's clock reaches nServerTime, or straight away if that
+			//has already passed. Used to make several clients act at the same instant, e.g. start playback. fn isn't
+			//run if the client is disconnected first.
+			template<typename F>
+			void RunAtServerTime(uint64_t nServerTime, F fn)
+			{
+				auto pTimer = std::make_shared<asio::steady_timer>(m_context);
+				pTimer->expires_at(std::chrono::steady_clock::time_point(std::chrono::duration_cast<
+					std::chrono::steady_clock::duration>(std::chrono::nanoseconds(ToLocalTime(nServerTime)))));
+				pTimer->async_wait([pTimer, fn = std::move(fn)](std::error_code ec) mutable
+					{
+						if (!ec)
+							fn();
+					});
+			}
+
 			// Retrieve queue of infos from server
-			threadsafeQueue<owned_info<T>>& Incoming()
+			inbound_queue_t<T>& Incoming()
 			{
 				return m_qInfosIn;
 			}
@@ -100,22 +249,27 @@ namespace tl
 			//Send info to server
 			void Send(const info<T>& info)
 			{
-				std::cout<<"sent request\n";
+				TL_NET_LOG_TRACE(client, "Sending info {} of {} bytes", info.header.id, info.header.size);
 				if (IsConnected())
 					m_connection->Send(info);
 			}
 
+			//Send info to server, moving its body along instead of copying it
+			void Send(info<T>&& info)
+			{
+				TL_NET_LOG_TRACE(client, "Sending info {} of {} bytes", info.header.id, info.header.size);
+				if (IsConnected())
+					m_connection->Send(std::move(info));
+			}
+
 			void addToUserCommands(U command_id)
 			{
 				user_command<U> user_command{};
 				user_command.id = command_id;
 				
-				//The command_id object prints the value with no problem
-				std::cout<<"the command id:\n"<< command_id<<std::endl;
-
 				m_nUserCommands.push_back(user_command);
 
-				std::cout<<"m_nUserCommands.size(): "<<m_nUserCommands.size()<<std::endl;
+				TL_NET_LOG_DEBUG(client, "Queued user command {}, {} waiting", command_id, m_nUserCommands.size());
 				
 			}
 
@@ -125,8 +279,41 @@ namespace tl
 				return m_nUserCommands;
 			}
 
+			//Becomes readable when an info comes in, a user command is added or the connection closes, so that an
+			//event loop can sleep until the client has something to do instead of polling the queues:
+			//
+			//	poll Ready().GetFd() for POLLIN
+			//	Ready().Clear()
+			//	drain Incoming() and UserCommands() until both are empty, check IsConnected()
+			//
+			//net_glib.h does this from a GLib main loop.
+			readiness_event& Ready()
+			{
+				return m_ready;
+			}
+
 
 		protected:
+			void MakeConnection(transport_stream socket, const session_token& resume)
+			{
+				m_connection = std::make_shared<Connection<T>>(Connection<T>::owner::client, m_context, std::move(socket), m_qInfosIn);
+				m_connection->SetHeartbeat(m_heartbeat);
+				m_connection->SetTimeouts(m_timeouts);
+				m_connection->SetResumeToken(resume);
+			}
+
+			// Start context thread. It is kept running between connections so that Reconnect() can reuse it,
+			// and only stops in Disconnect().
+			void StartContext()
+			{
+				if (!thrContext.joinable())
+				{
+					m_context.restart();
+					m_work.emplace(m_context.get_executor());
+					thrContext = std::thread([this]() {m_context.run(); });
+				}
+			}
+
 			//ASIO context ahndles the data transfer
 			asio::io_context m_context;
 			//The context alone doesn't do very much. It needs a thread of its own
@@ -140,11 +327,25 @@ namespace tl
 			//single instance of a "connection" object, which handles
 			//data transfer. Once the connection object is created, the client
 			//interface will hand over the ASIO stuff to the connection.
-			std::unique_ptr<Connection<T>> m_connection;
+			std::shared_ptr<Connection<T>> m_connection;
+			heartbeat_settings m_heartbeat;
+			timeout_settings m_timeouts;
+
+			//Keeps the io thread running while there is no connection, between a drop and Reconnect()
+			std::optional<asio::executor_work_guard<asio::io_context::executor_type>> m_work;
+			//Where and how the last Connect went, for Reconnect()
+			transport_kind m_nTransport = transport_kind::tcp;
+			std::string m_sHost;
+			uint16_t m_nPort = 0;
+			std::string m_sLocalPath;
+			size_t m_nRingBytes = nDefaultRingBytes;
+			session_token m_lastSession;
 
 		private:
+			//Declared before the queues that poke it, so it outlives them
+			readiness_event m_ready;
 			//This is the thread safe queue of the incoming infos from server.
-			threadsafeQueue<owned_info<T>> m_qInfosIn;
+			inbound_queue_t<T> m_qInfosIn;
 			threadsafeQueue<user_command<U>> m_nUserCommands; 
 			
 		};
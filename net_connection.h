@@ -3,6 +3,10 @@
 #include "net_base.h"
 #include "net_threadsafeQueue.hpp"
 #include "net_info.h"
+#include "net_log.hpp"
+#include "net_metrics.hpp"
+#include "net_timerWheel.hpp"
+#include "net_transport.hpp"
 
 namespace tl
 {
@@ -29,9 +33,24 @@ namespace tl
 			// Constructor: Specify Owner, connect to context, transfer the socket
 			//				Provide reference to incoming message queue
 
-			Connection(owner parent, asio::io_context& asioContext, asio::ip::tcp::socket socket, threadsafeQueue<owned_info<T>>& qIn)
-				:m_asioContext(asioContext), m_socket(std::move(socket)), m_qInfosIn(qIn)
+			Connection(owner parent, asio::io_context& asioContext, transport_stream socket, inbound_queue_t<T>& qIn)
+				:m_asioContext(asioContext), m_socket(std::move(socket)),
+				 m_wheel(asio::use_service<timer_wheel>(asioContext)), m_qInfosIn(qIn)
 			{
+				//Timers are only ever armed while the socket is open and Close() cancels them all, so by the time the
+				//connection can be destroyed none of them is armed and capturing this is safe.
+				m_timerHeartbeat.Bind(m_wheel, [this]() { OnHeartbeatTimer(); });
+				m_timerHandshake.Bind(m_wheel, [this]()
+					{
+						TL_NET_LOG_WARN(connection, "[{}] Handshake timed out, closing", id);
+						Close();
+					});
+				m_timerStalledWrite.Bind(m_wheel, [this]()
+					{
+						TL_NET_LOG_WARN(connection, "[{}] Write stalled, closing", id);
+						Close();
+					});
+
 				m_nOwnerType = parent;
 
 				//Construct validation check data
@@ -56,29 +75,48 @@ namespace tl
 			virtual ~Connection()
 			{}
 
-			//Only called by clients
+			//Only called by clients. Connects over TCP to the first of endpoints that answers.
 			void ConnectToServer(const asio::ip::tcp::resolver::results_type& endpoints)
 			{
-				if (m_nOwnerType == owner::client)
-					//Request ASIO attempts to connect to an endpoint
-					asio::async_connect(m_socket, endpoints,
-						[this](std::error_code ec, asio::ip::tcp::endpoint endpoint) {
-							if (!ec)
-							{
-								std::cout << "Connected to server\n";
-								//ReadHeader();
+				if (m_nOwnerType != owner::client || !m_socket.socket())
+					return;
 
-								//First thing server will do is send packet to be validated 
-								//so wait for that and respond
-								ReadValidation();
-							}
+				//The socket is a generic one that also does AF_UNIX, so it takes the endpoints in generic form
+				std::vector<asio::generic::stream_protocol::endpoint> vEndpoints;
+				for (const auto& entry : endpoints)
+					vEndpoints.emplace_back(entry.endpoint());
+
+				//Request ASIO attempts to connect to an endpoint
+				asio::async_connect(*m_socket.socket(), vEndpoints,
+					[this, self = KeepAlive()](asio::error_code ec, const asio::generic::stream_protocol::endpoint&) {
+						OnConnected(ec);
+					});
+			}
+
+			//Only called by clients. Connects to a local (AF_UNIX) endpoint.
+			void ConnectToServer(const asio::generic::stream_protocol::endpoint& endpoint)
+			{
+				if (m_nOwnerType == owner::client && m_socket.socket())
+					m_socket.socket()->async_connect(endpoint,
+						[this, self = KeepAlive()](asio::error_code ec) {
+							OnConnected(ec);
 						});
 			}
+
+			//Only called by clients, when the transport was already connected before the connection was made from
+			//it, as shared memory is
+			void ConnectToServer()
+			{
+				if (m_nOwnerType == owner::client)
+					asio::post(m_asioContext, [this, self = KeepAlive()]() {
+						OnConnected(m_socket.is_open() ? asio::error_code() : asio::error::not_connected);
+					});
+			}
 			//Called by clients and server
 			void Disconnect()
 			{
 				if (IsConnected())
-					asio::post(m_asioContext, [this]() { m_socket.close(); });
+					asio::post(m_asioContext, [this, self = KeepAlive()]() { Close(); });
 			}
 			//Returns if the connection is valid, open, and currently active
 			bool IsConnected() const
@@ -86,19 +124,47 @@ namespace tl
 				return m_socket.is_open();
 			}
 
-			void Send(const info<T>& info)
+			void Send(const info<T>& info, send_kind kind = send_kind::reliable, send_lane lane = send_lane::automatic)
 			{
-				asio::post(m_asioContext, 
-					[this, info](){
+				Send(make_shared_info(info), kind, lane);
+			}
 
-						bool bWritingMessage = !m_qInfosOut.empty();
+			//Takes the info over, so its body goes from the caller to the socket without being copied
+			void Send(info<T>&& info, send_kind kind = send_kind::reliable, send_lane lane = send_lane::automatic)
+			{
+				Send(make_shared_info(std::move(info)), kind, lane);
+			}
 
-						m_qInfosOut.push_back(info);
-						
-						if(!bWritingMessage)
-							WriteHeader();
+			//Queues an info that may be shared with other connections. Only the reference is copied, never the body.
+			void Send(shared_info<T> pInfo, send_kind kind = send_kind::reliable, send_lane lane = send_lane::automatic)
+			{
+				outgoing_info<T> out{ std::move(pInfo) };
+				out.kind = kind;
+				out.lane = lane;
+				Enqueue(std::move(out));
+			}
 
-					});
+			//Queues an info whose body is prefixed by nLength bytes of pFile starting at nOffset. The header goes out
+			//with the normal write path, and the file bytes go straight from the page cache to the socket with
+			//sendfile(), without ever being copied into user space. It keeps its place in the out queue, so infos
+			//sent before and after it are still delivered in order around it.
+			//Returns false, and sends nothing, if the file bytes and the body together don't fit in the header's size.
+			bool SendFile(std::shared_ptr<file_source> pFile, uint64_t nOffset, uint32_t nLength, info<T> info = {},
+				send_lane lane = send_lane::automatic)
+			{
+				//A size that wrapped around would describe fewer bytes than go on the wire, and the remote would
+				//read the rest as the next header
+				if (info.body.size() > std::numeric_limits<uint32_t>::max() - nLength)
+				{
+					TL_NET_LOG_WARN(connection, "[{}] File region of {} bytes too large to send with a {} byte body", id, nLength, info.body.size());
+					return false;
+				}
+
+				info.header.size = nLength + uint32_t(info.body.size());
+				outgoing_info<T> out{ make_shared_info(std::move(info)), std::move(pFile), nOffset, nLength };
+				out.lane = lane;
+				Enqueue(std::move(out));
+				return true;
 			}
 
 			uint32_t GetID() const
@@ -106,6 +172,243 @@ namespace tl
 				return id;
 			}
 
+			//Sets how much may be queued for sending before the policy kicks in. Set this before the connection is
+			//used, it is read by every thread that calls Send.
+			void SetBackpressure(const send_watermarks& watermarks, backpressure_policy policy)
+			{
+				m_watermarks = watermarks;
+				m_nBackpressurePolicy = policy;
+			}
+
+			//Bytes queued for sending that haven't been written to the socket yet. A client that is falling behind
+			//shows up here first.
+			size_t GetQueuedBytes() const
+			{
+				return m_nQueuedBytes.load(std::memory_order_relaxed);
+			}
+
+			size_t GetQueuedInfos() const
+			{
+				return m_nQueuedInfos.load(std::memory_order_relaxed);
+			}
+
+			//True from the moment the high watermark is crossed until the queue has drained to the low watermark
+			bool IsCongested() const
+			{
+				return m_bCongested.load(std::memory_order_relaxed);
+			}
+
+			//Sets how often heartbeats are sent and when the remote side is given up on. Set this before the
+			//connection is used.
+			void SetHeartbeat(const heartbeat_settings& settings)
+			{
+				m_heartbeat = settings;
+			}
+
+			//Sets the handshake and stalled write deadlines. Set this before the connection is used.
+			void SetTimeouts(const timeout_settings& settings)
+			{
+				m_timeouts = settings;
+			}
+
+			//Smoothed round trip time, measured with heartbeats. Zero until the first pong has come back.
+			std::chrono::nanoseconds GetRtt() const
+			{
+				return std::chrono::nanoseconds(m_nSmoothedRtt.load(std::memory_order_relaxed));
+			}
+
+			//How much the round trip time varies around GetRtt()
+			std::chrono::nanoseconds GetRttJitter() const
+			{
+				return std::chrono::nanoseconds(m_nRttJitter.load(std::memory_order_relaxed));
+			}
+
+			//How far the remote side's steady_clock is ahead of this side's, estimated from heartbeats. Adding it to a
+			//local time gives the same instant on the remote clock. Zero until IsClockSynced().
+			std::chrono::nanoseconds GetClockOffset() const
+			{
+				return std::chrono::nanoseconds(m_nClockOffset.load(std::memory_order_relaxed));
+			}
+
+			//True once a pong has come back and GetClockOffset() means something
+			bool IsClockSynced() const
+			{
+				return m_bClockSynced.load(std::memory_order_acquire);
+			}
+
+			//Converts between this side's and the remote side's steady_clock, both in nanoseconds as returned by
+			//SteadyNanoseconds()
+			uint64_t ToRemoteTime(uint64_t nLocal) const
+			{
+				return uint64_t(int64_t(nLocal) + GetClockOffset().count());
+			}
+
+			uint64_t ToLocalTime(uint64_t nRemote) const
+			{
+				return uint64_t(int64_t(nRemote) - GetClockOffset().count());
+			}
+
+			//Only called by clients, before ConnectToServer. The connection then asks to resume that session rather
+			//than going through validation, and falls back to validation if the server no longer has it.
+			void SetResumeToken(const session_token& token)
+			{
+				m_resumeToken = token;
+			}
+
+			//The session the server has given this connection, invalid until it has sent one. Safe to call from any
+			//thread.
+			session_token GetSessionToken() const
+			{
+				std::scoped_lock lock(m_muxSession);
+				return m_session;
+			}
+
+			//True once the server has accepted a session this connection asked to resume
+			bool IsResumed() const
+			{
+				return m_bResumed.load(std::memory_order_acquire);
+			}
+
+			//Set by the server while the connection has dropped but its session may still be resumed. A detached
+			//connection keeps its place and ID in the server, and infos sent to it are dropped.
+			bool IsDetached() const
+			{
+				return m_bDetached.load(std::memory_order_acquire);
+			}
+
+			void SetDetached(bool bDetached)
+			{
+				m_bDetached.store(bDetached, std::memory_order_release);
+			}
+
+			//Totals since the connection was made. Safe to call from any thread.
+			connection_stats GetStats() const
+			{
+				connection_stats s;
+				s.nID = id;
+				s.nBytesIn = m_nBytesIn.Get();
+				s.nBytesOut = m_nBytesOut.Get();
+				s.nInfosIn = m_nInfosIn.Get();
+				s.nInfosOut = m_nInfosOut.Get();
+				s.nQueuedInfos = GetQueuedInfos();
+				s.nQueuedBytes = GetQueuedBytes();
+				s.bCongested = IsCongested();
+				s.nRttNanoseconds = uint64_t(GetRtt().count());
+				s.nRttJitterNanoseconds = uint64_t(GetRttJitter().count());
+				s.nClockOffsetNanoseconds = GetClockOffset().count();
+				return s;
+			}
+
+			//Sets how the interactive and bulk lanes share the connection when both have something to send. With the
+			//default of 4 to 1, bulk infos get a fifth of the bytes while interactive infos are waiting.
+			void SetLaneWeights(uint32_t nInteractive, uint32_t nBulk)
+			{
+				m_nLaneWeight[size_t(send_lane::interactive)] = std::max<uint32_t>(nInteractive, 1);
+				m_nLaneWeight[size_t(send_lane::bulk)] = std::max<uint32_t>(nBulk, 1);
+			}
+
+			//Caps how many bytes of queued infos are gathered into one write. Larger batches mean fewer system calls,
+			//smaller ones mean the socket buffer is topped up sooner.
+			void SetMaxWriteBatchBytes(size_t nBytes)
+			{
+				m_nMaxWriteBatchBytes = nBytes;
+			}
+
+			//Reads the next info from the socket into into, reusing its body's storage. Instead of one read for each
+			//header and another for each body, every read asks the kernel for as much as it has, up to the free space
+			//in m_vReadBuffer, and later calls take their infos from what is already buffered, so a burst of small
+			//infos costs one system call, not two each. A large body is read straight into into rather than being
+			//copied through the buffer.
+			//Must be awaited on this connection's io_context. Once the connection has been validated its own read
+			//loop is the reader, so this is for building other loops on, not for calling alongside it.
+			asio::awaitable<asio::error_code> ReadInfo(info<T>& into)
+			{
+				asio::error_code ec;
+				for (;;)
+				{
+					size_t nBuffered = m_nReadEnd - m_nReadStart;
+					if (nBuffered >= sizeof(info_header<T>))
+					{
+						const uint8_t* pFrame = m_vReadBuffer.data() + m_nReadStart;
+						nBuffered -= sizeof(info_header<T>);
+
+						std::memcpy(&into.header, pFrame, sizeof(info_header<T>));
+						size_t nBody = into.header.size;
+
+						if (nBuffered >= nBody)
+						{
+							//The whole info is already here
+							into.body.assign(pFrame + sizeof(info_header<T>), pFrame + sizeof(info_header<T>) + nBody);
+							m_nReadStart += sizeof(info_header<T>) + nBody;
+							co_return ec;
+						}
+
+						if (nBody >= nDirectReadThreshold)
+						{
+							//Take the part we already have and read the rest straight into the info, which overwrites
+							//every byte of the body
+							resize_uninitialized(into.body, nBody);
+							std::memcpy(into.body.data(), pFrame + sizeof(info_header<T>), nBuffered);
+							m_nReadStart = m_nReadEnd = 0;
+
+							size_t nLength = co_await asio::async_read(m_socket,
+								asio::buffer(into.body.data() + nBuffered, nBody - nBuffered),
+								asio::redirect_error(asio::use_awaitable, ec));
+							if (!ec)
+							{
+								m_nBytesIn.Add(nLength);
+								m_nLastReceived = SteadyNanoseconds();
+							}
+							co_return ec;
+						}
+
+						//Only part of a small info has arrived, wait for the rest
+					}
+
+					if (m_vReadBuffer.empty())
+						m_vReadBuffer.resize(nReadBufferSize);
+
+					//Move any partial info left over from the last read to the front, so there is room behind it.
+					if (m_nReadStart > 0)
+					{
+						std::memmove(m_vReadBuffer.data(), m_vReadBuffer.data() + m_nReadStart, m_nReadEnd - m_nReadStart);
+						m_nReadEnd -= m_nReadStart;
+						m_nReadStart = 0;
+					}
+
+					size_t nLength = co_await m_socket.async_read_some(
+						asio::buffer(m_vReadBuffer.data() + m_nReadEnd, m_vReadBuffer.size() - m_nReadEnd),
+						asio::redirect_error(asio::use_awaitable, ec));
+					if (ec)
+						co_return ec;
+
+					m_nBytesIn.Add(nLength);
+					m_nLastReceived = SteadyNanoseconds();
+					m_nReadEnd += nLength;
+				}
+			}
+
+			//Queues info like Send and completes once it has been handed to the kernel, or with an error if the
+			//connection closes before that. Must be awaited on this connection's io_context.
+			asio::awaitable<asio::error_code> WriteInfo(const info<T>& info, send_lane lane = send_lane::automatic)
+			{
+				if (!m_asioContext.get_executor().running_in_this_thread())
+					co_return asio::error::operation_not_supported;
+
+				write_waiter waiter(co_await asio::this_coro::executor);
+				outgoing_info<T> out{ make_shared_info(info) };
+				out.lane = lane;
+				out.pWaiter = &waiter;
+				Enqueue(std::move(out));
+
+				if (!waiter.bDone)
+				{
+					asio::error_code ec;
+					co_await waiter.timer.async_wait(asio::redirect_error(asio::use_awaitable, ec));
+				}
+				co_return waiter.ec;
+			}
+
 			void ConnectToClient(tl::net::server_interface<T>* server,  uint32_t uid = 0)
 			{
 				if (m_nOwnerType == owner::server)
@@ -113,7 +416,16 @@ namespace tl
 					if (m_socket.is_open())
 					{
 						id = uid;
-						std::cout << "scpket cnnection now open with client from server\n";
+						m_pServer = server;
+						TL_NET_LOG_DEBUG(connection, "[{}] Socket connection now open with client from server", uid);
+						SetNoDelay();
+
+						//We may be on the thread of the worker that accepted, the timer belongs to this connection's
+						asio::post(m_asioContext, [this, self = KeepAlive()]()
+							{
+								if (m_socket.is_open() && m_timeouts.handshake.count() > 0)
+									m_timerHandshake.Arm(m_timeouts.handshake);
+							});
 						//ReadHeader();
 						//A client has attempted to connect to the server, but we wish
 						//the client to first validate itself, so first write out the 
@@ -127,132 +439,659 @@ namespace tl
 				}
 			}
 		private:
-			//ASYNC - Prime context ready to read an info header 
-			void ReadHeader()
+			//The read side of the connection in one straight line: read an info, hand it on, repeat. The coroutine
+			//frame, and the state of each read it awaits, come from asio's per-thread recycling allocator, so once
+			//the loop is running no info costs a heap allocation beyond its own body. self keeps the connection alive
+			//for as long as the loop runs, like the KeepAlive() every handler holds.
+			asio::awaitable<void> ReadLoop(std::shared_ptr<Connection<T>> self)
 			{
-				asio::async_read(m_socket, asio::buffer(&m_infoTemporaryIn.header, sizeof(info_header<T>)),
-					[this](std::error_code ec, std::size_t length)
+				for (;;)
+				{
+					asio::error_code ec = co_await ReadInfo(m_infoTemporaryIn);
+					if (ec)
 					{
-						if (!ec)
-						{
-							if (m_infoTemporaryIn.header.size > 0)
+						TL_NET_LOG_WARN(connection, "[{}] Read Fail: {}", id, ec.message());
+						//Manually force close scoket
+						Close();
+						co_return;
+					}
+					AddToIncomingInfoQueue();
+				}
+			}
+
+			void StartReading()
+			{
+				asio::co_spawn(m_asioContext, ReadLoop(KeepAlive()), asio::detached);
+			}
+
+			//Runs on whichever thread calls Send. The queued totals are counted here, before the info is handed to
+			//the io thread, so that a producer sees the effect of its own sends straight away.
+			void Enqueue(outgoing_info<T> out)
+			{
+				if (IsAboveHighWatermark())
+				{
+					if (m_nBackpressurePolicy == backpressure_policy::disconnect)
+					{
+						SetCongested(true);
+						TL_NET_LOG_WARN(connection, "[{}] Disconnecting slow client", id);
+						Disconnect();
+						if (out.pWaiter)
+							out.pWaiter->Complete(asio::error::no_buffer_space);
+						return;
+					}
+
+					//The io thread itself must never wait, it is the one that drains the queue
+					if (m_nBackpressurePolicy == backpressure_policy::block && !m_asioContext.get_executor().running_in_this_thread())
+						WaitForDrain();
+				}
+
+				if (out.lane == send_lane::automatic)
+					out.lane = info_lane<T>::Of(out.pInfo->header.id);
+
+				m_nQueuedBytes.fetch_add(out.Bytes(), std::memory_order_relaxed);
+				m_nQueuedInfos.fetch_add(1, std::memory_order_relaxed);
+
+				bool bCongested = IsAboveHighWatermark();
+				if (bCongested)
+					SetCongested(true);
+
+				asio::post(m_asioContext, 
+					[this, self = KeepAlive(), out = std::move(out), bCongested]() mutable {
+
+						if (!reserved_ids<T>::IsReserved(out.pInfo->header.id))
+							m_nLastActivity = SteadyNanoseconds();
+						m_qLanes[size_t(out.lane)].push_back(std::move(out));
+
+						if (bCongested)
+							Prune();
+						
+						//Nothing goes out before the handshake is over, it would be taken for part of it
+						if(!m_bWriting && m_bEstablished)
+							WriteInfos();
+
+					});
+			}
+
+			bool IsAboveHighWatermark() const
+			{
+				return m_nQueuedBytes.load(std::memory_order_relaxed) > m_watermarks.nHighBytes
+					|| m_nQueuedInfos.load(std::memory_order_relaxed) > m_watermarks.nHighInfos;
+			}
+
+			bool IsBelowLowWatermark() const
+			{
+				return m_nQueuedBytes.load(std::memory_order_relaxed) <= m_watermarks.nLowBytes
+					&& m_nQueuedInfos.load(std::memory_order_relaxed) <= m_watermarks.nLowInfos;
+			}
+
+			//Tells the server when the connection starts and stops falling behind, once for each change
+			void SetCongested(bool bCongested)
+			{
+				if (m_bCongested.exchange(bCongested) == bCongested)
+					return;
+
+				if (!bCongested)
+				{
+					std::scoped_lock lock(m_muxDrained);
+					m_cvDrained.notify_all();
+				}
+
+				if (m_pServer)
+					m_pServer->OnBackpressure(this->shared_from_this(), bCongested);
+			}
+
+			//Blocks the calling thread until the queue has drained to the low watermark or the connection is gone
+			void WaitForDrain()
+			{
+				std::unique_lock<std::mutex> ul(m_muxDrained);
+				while (!IsBelowLowWatermark() && IsConnected())
+					m_cvDrained.wait_for(ul, std::chrono::milliseconds(100));
+			}
+
+			//ASYNC - Removes entries from the lanes according to the backpressure policy. Entries that are being
+			//written at the moment have already left their lane, so they are never touched.
+			void Prune()
+			{
+				size_t nRemovedBytes = 0;
+				size_t nRemoved = 0;
+
+				if (m_nBackpressurePolicy == backpressure_policy::drop_oldest)
+				{
+					size_t nExcessBytes = m_nQueuedBytes.load() > m_watermarks.nLowBytes ? m_nQueuedBytes.load() - m_watermarks.nLowBytes : 0;
+					size_t nExcessInfos = m_nQueuedInfos.load() > m_watermarks.nLowInfos ? m_nQueuedInfos.load() - m_watermarks.nLowInfos : 0;
+
+					//Bulk first, since that is where droppable media normally sits
+					for (size_t nLane = nLanes; nLane-- > 0;)
+						m_qLanes[nLane].erase_if(0, [&](const outgoing_info<T>& out)
 							{
-								std::cout << "m_infoTemporaryIn.header.size > 0\n";
-								m_infoTemporaryIn.body.resize(m_infoTemporaryIn.header.size);
-								ReadBody();
-							}
+								if (out.kind != send_kind::droppable || (nRemovedBytes >= nExcessBytes && nRemoved >= nExcessInfos))
+									return false;
+								nRemovedBytes += out.Bytes();
+								nRemoved++;
+								return true;
+							});
+				}
+				else if (m_nBackpressurePolicy == backpressure_policy::coalesce)
+				{
+					for (auto& qLane : m_qLanes)
+					{
+						//Walking from the newest entry backwards, the first state info seen for each id is the one to keep
+						std::vector<T> vSeen;
+						std::vector<bool> vKeep(qLane.size(), true);
+						for (size_t i = qLane.size(); i-- > 0;)
+						{
+							const outgoing_info<T>& out = qLane.at(i);
+							if (out.kind != send_kind::state)
+								continue;
+							T infoID = out.pInfo->header.id;
+							if (std::find(vSeen.begin(), vSeen.end(), infoID) != vSeen.end())
+								vKeep[i] = false;
 							else
+								vSeen.push_back(infoID);
+						}
+
+						size_t i = 0;
+						nRemoved += qLane.erase_if(0, [&](const outgoing_info<T>& out)
 							{
-								AddToIncomingInfoQueue();
-							}
+								if (vKeep[i++])
+									return false;
+								nRemovedBytes += out.Bytes();
+								return true;
+							});
+					}
+				}
 
-						}
-						else
-						{
-							std::cout << "[" << id << "] Read Header Fail.\n";
-							//Manually force close scoket
-							m_socket.close();
-						}
-					});
+				if (nRemoved > 0)
+				{
+					m_nQueuedBytes.fetch_sub(nRemovedBytes, std::memory_order_relaxed);
+					m_nQueuedInfos.fetch_sub(nRemoved, std::memory_order_relaxed);
+					if (IsBelowLowWatermark())
+						SetCongested(false);
+				}
+			}
+
+			//ASYNC - Chooses the lane the next info to be written comes from, or returns nLanes if there is nothing
+			//to write. The control lane always wins. Between interactive and bulk it is deficit round robin: each
+			//turn a lane is credited with its weight in bytes and may send infos until its credit runs out.
+			size_t PickLane(bool bBulkAllowed)
+			{
+				const size_t nInteractive = size_t(send_lane::interactive);
+				const size_t nBulk = size_t(send_lane::bulk);
+				m_nLastCharge = 0;
+
+				if (!m_qLanes[size_t(send_lane::control)].empty())
+					return size_t(send_lane::control);
+
+				bool bInteractive = !m_qLanes[nInteractive].empty();
+				bool bBulk = bBulkAllowed && !m_qLanes[nBulk].empty();
+
+				//The weights only matter while both lanes are competing
+				if (!bBulk)
+					return bInteractive ? nInteractive : nLanes;
+				if (!bInteractive)
+					return nBulk;
+
+				for (;;)
+				{
+					size_t nLane = m_nDrrLane;
+					size_t nBytes = m_qLanes[nLane].front().Bytes();
+
+					if (m_nDeficit[nLane] >= nBytes)
+					{
+						m_nDeficit[nLane] -= nBytes;
+						m_nLastCharge = nBytes;
+						return nLane;
+					}
+
+					m_nDeficit[nLane] += m_nLaneWeight[nLane] * nLaneQuantum;
+					m_nDrrLane = nLane == nInteractive ? nBulk : nInteractive;
+				}
 			}
 
-			//ASYNC - Prime context ready to read an info body
-			void ReadBody()
+			//ASYNC - We are done with the info at the front of the queue
+			void PopOutgoing()
 			{
-				std::cout << "Size of body: " << m_infoTemporaryIn.body.size() << std::endl;
-				asio::async_read(m_socket, asio::buffer(m_infoTemporaryIn.body.data(), m_infoTemporaryIn.body.size()),
-					[this](std::error_code ec, std::size_t length)
+				m_nQueuedBytes.fetch_sub(m_qInfosOut.front().Bytes(), std::memory_order_relaxed);
+				m_nQueuedInfos.fetch_sub(1, std::memory_order_relaxed);
+				if (m_qInfosOut.front().pWaiter)
+					m_qInfosOut.front().pWaiter->Complete({});
+				m_qInfosOut.pop_front();
+				m_nInfosOut.Add();
+
+				if (m_bCongested.load(std::memory_order_relaxed) && IsBelowLowWatermark())
+					SetCongested(false);
+			}
+
+			//ASYNC - Prime context ready to write every queued info in one go
+			//Rather than one async_write for the header and another for the body of each info, the headers and bodies
+			//of as many queued infos as fit under m_nMaxWriteBatchBytes are gathered into a single buffer sequence,
+			//which asio hands to the kernel as one writev(). All of them are popped together when it completes.
+			//Infos are taken from the lanes in the order PickLane() gives, and moved into m_qInfosOut while they are
+			//being written.
+			void WriteInfos()
+			{
+				m_vWriteBuffers.clear();
+
+				size_t nBatchBytes = 0;
+				bool bBulkTaken = false;
+				bool bFileInFlight = false;
+
+				while (m_vWriteBuffers.size() + 2 <= nMaxWriteBuffers)
+				{
+					size_t nLane = PickLane(!bBulkTaken);
+					if (nLane == nLanes)
+						break;
+
+					const info<T>& next = *m_qLanes[nLane].front().pInfo;
+					size_t nInfoBytes = sizeof(info_header<T>) + next.body.size();
+
+					//The first info is always taken, even if it alone is larger than the cap.
+					if (!m_qInfosOut.empty() && nBatchBytes + nInfoBytes > m_nMaxWriteBatchBytes)
+					{
+						//It stays at the front of its lane for the next batch, so give back what it was charged
+						m_nDeficit[nLane] += m_nLastCharge;
+						break;
+					}
+
+					m_qInfosOut.push_back(m_qLanes[nLane].pop_front());
+					const outgoing_info<T>& out = m_qInfosOut.back();
+					const info<T>& info = *out.pInfo;
+
+					m_vWriteBuffers.push_back(asio::buffer(&info.header, sizeof(info_header<T>)));
+					bBulkTaken |= nLane == size_t(send_lane::bulk);
+
+					//An info sent from a file ends the batch after its header. The file bytes and the body follow
+					//once the batch has been written.
+					if (out.pFile)
+					{
+						bFileInFlight = true;
+						break;
+					}
+
+					if (!info.body.empty())
+						m_vWriteBuffers.push_back(asio::buffer(info.body.data(), info.body.size()));
+
+					nBatchBytes += nInfoBytes;
+				}
+
+				m_bWriting = !m_qInfosOut.empty();
+				if (!m_bWriting)
+				{
+					m_timerStalledWrite.Cancel();
+					return;
+				}
+
+				ArmStalledWrite();
+				TL_NET_LOG_TRACE(connection, "[{}] Writing {} infos", id, m_qInfosOut.size());
+				asio::async_write(m_socket, m_vWriteBuffers, WriteProgress(),
+					[this, self = KeepAlive(), bFileInFlight](std::error_code ec, std::size_t length)
 					{
 						if (!ec)
 						{
-							std::cout << "Read body\n";
-							AddToIncomingInfoQueue();
+							m_nBytesOut.Add(length);
+							//We are done with every info in the batch so we remove them, except an info still
+							//waiting for its file bytes.
+							while (m_qInfosOut.size() > (bFileInFlight ? 1 : 0))
+								PopOutgoing();
+
+							if (bFileInFlight)
+							{
+								m_nFileBytesSent = 0;
+								WriteFile();
+							}
+							//If there are more messages to send.
+							else
+								WriteInfos();
 						}
 						else
 						{
-							std::cout << "[" << id << "] Read Body Fail.\n";
+							TL_NET_LOG_WARN(connection, "[{}] Write Fail: {}", id, ec.message());
 							//Manually force close scoket
-							m_socket.close();
+							Close();
 						}
 					});
 			}
 
-			//ASYNC - Prime context ready to write an info header
-			void WriteHeader()
+			//ASYNC - Send the file bytes of the info at the front of the queue, whose header has been written
+			void WriteFile()
 			{
-				std::cout<<"writing header\n";
-				asio::async_write(m_socket, asio::buffer(&m_qInfosOut.front().header, sizeof(info_header<T>)),
-					[this](std::error_code ec, std::size_t length)
+				const outgoing_info<T>& out = m_qInfosOut.front();
+
+#if defined(__linux__)
+				//sendfile() needs a socket to send to. Shared memory has none, so it copies like other platforms do.
+				stream_socket* pSocket = m_socket.socket();
+				if (!pSocket)
+				{
+					WriteFileCopy();
+					return;
+				}
+
+				//sendfile() is used with the socket in non-blocking mode: it sends whatever the socket buffer has room
+				//for and we then wait for the socket to become writable again, rather than blocking the io thread.
+				pSocket->native_non_blocking(true);
+
+				while (m_nFileBytesSent < out.nFileLength)
+				{
+					off_t nOffset = off_t(out.nFileOffset + m_nFileBytesSent);
+					ssize_t n = ::sendfile(pSocket->native_handle(), out.pFile->fd, &nOffset, out.nFileLength - m_nFileBytesSent);
+
+					if (n > 0)
 					{
-						if (!ec)
-						{
-							if (m_qInfosOut.front().body.size()>0)
+						m_nFileBytesSent += uint32_t(n);
+						m_nBytesOut.Add(uint64_t(n));
+					}
+					else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+					{
+						ArmStalledWrite();
+						pSocket->async_wait(stream_socket::wait_write,
+							[this, self = KeepAlive()](std::error_code ec)
 							{
-								WriteBody();
-							}
-							else{
-								//We are done with the info in the queue so we remove it.
-								m_qInfosOut.pop_front();
+								if (!ec)
+									WriteFile();
+								else
+									Close();
+							});
+						return;
+					}
+					else if (n < 0 && errno == EINTR)
+					{
+					}
+					else
+					{
+						//Either an error, or the file is shorter than the info claimed. The remote would be left
+						//waiting for bytes that never come, so the connection can't be used any more.
+						TL_NET_LOG_WARN(connection, "[{}] Send File Fail", id);
+						Close();
+						return;
+					}
+				}
 
-								//If there are more messages to send.
-								if (!m_qInfosOut.empty())
-									WriteHeader();
-							}
-						}
-						else
+				WriteFileBody();
+#else
+				WriteFileCopy();
+#endif
+			}
+
+			//ASYNC - Without sendfile() the file bytes are read into memory one piece at a time and written as usual.
+			void WriteFileCopy()
+			{
+				const outgoing_info<T>& out = m_qInfosOut.front();
+				size_t nLength = std::min<size_t>(out.nFileLength - m_nFileBytesSent, nReadBufferSize);
+				m_vFileBuffer.resize(nLength);
+
+				ssize_t n = ::pread(out.pFile->fd, m_vFileBuffer.data(), nLength, off_t(out.nFileOffset + m_nFileBytesSent));
+				if (n <= 0)
+				{
+					TL_NET_LOG_WARN(connection, "[{}] Send File Fail", id);
+					Close();
+					return;
+				}
+
+				ArmStalledWrite();
+				asio::async_write(m_socket, asio::buffer(m_vFileBuffer.data(), size_t(n)), WriteProgress(),
+					[this, self = KeepAlive()](std::error_code ec, std::size_t length)
+					{
+						if (ec)
 						{
-							std::cout << "[" << id << "] Write Header Fail.\n";
-							//Manually force close scoket
-							m_socket.close();
+							Close();
+							return;
 						}
+
+						m_nFileBytesSent += uint32_t(length);
+						m_nBytesOut.Add(length);
+						if (m_nFileBytesSent < m_qInfosOut.front().nFileLength)
+							WriteFileCopy();
+						else
+							WriteFileBody();
 					});
 			}
 
-			//ASYNC - Prime context ready to write an info body
-			void WriteBody()
+			//ASYNC - Finish the info at the front of the queue by writing the body that follows its file bytes
+			void WriteFileBody()
 			{
-				asio::async_write(m_socket, asio::buffer(m_qInfosOut.front().body.data(), m_qInfosOut.front().body.size()),
-					[this](std::error_code ec, std::size_t length)
+				const info<T>& info = *m_qInfosOut.front().pInfo;
+
+				ArmStalledWrite();
+				asio::async_write(m_socket, asio::buffer(info.body.data(), info.body.size()), WriteProgress(),
+					[this, self = KeepAlive()](std::error_code ec, std::size_t length)
 					{
 						if (!ec)
 						{
-							//We are done with the info in the queue so we remove it.
-							m_qInfosOut.pop_front();
-
-							//If there are more messages to send.
-							if (!m_qInfosOut.empty())
-								WriteHeader();
+							m_nBytesOut.Add(length);
+							PopOutgoing();
+							WriteInfos();
 						}
 						else
 						{
-							std::cout << "[" << id << "] Write Body Fail.\n";
-							//Manually force close scoket
-							m_socket.close();
+							TL_NET_LOG_WARN(connection, "[{}] Write Body Fail: {}", id, ec.message());
+							Close();
 						}
-					}
-					);
+					});
 			}
 
 			void AddToIncomingInfoQueue()
 			{
-				std::cout << "added to incoming info queue "<<(int)m_nOwnerType << std::endl;
+				TL_NET_LOG_TRACE(connection, "[{}] Added info {} of {} bytes to incoming queue", id, m_infoTemporaryIn.header.id, m_infoTemporaryIn.header.size);
+				uint64_t nNow = SteadyNanoseconds();
+				if (reserved_ids<T>::IsReserved(m_infoTemporaryIn.header.id))
+				{
+					//Only the server hands out sessions. One sent by a client is dropped, or it could replace the token
+					//the server gave it and that GetSessionToken() reports.
+					if (m_infoTemporaryIn.header.id == reserved_ids<T>::session)
+					{
+						if (m_nOwnerType == owner::client)
+							OnSessionToken();
+						else
+							TL_NET_LOG_WARN(connection, "[{}] Dropped a session token sent by the client", id);
+					}
+					else
+						OnHeartbeat(nNow);
+					return;
+				}
+
+				m_nInfosIn.Add();
+				m_nLastActivity = nNow;
+
+				//The body is moved into the queue rather than copied. m_infoTemporaryIn is left with an empty body,
+				//and the next info to arrive takes a fresh one from the buffer pool.
 				if (m_nOwnerType == owner::server)
-					m_qInfosIn.push_back({ this->shared_from_this(), m_infoTemporaryIn });
+					m_qInfosIn.push_back({ this->shared_from_this(), std::move(m_infoTemporaryIn), nNow });
 				//In the case m_nOwnerType is a client we are not concerned with tagging the connection with the this->shared_from_this() pointer
 				//since the client will only have connection to one endpoint, that's the server, so the tagging is unneccessary.
-				//This is an important distinction because we want to enforce that a client can only have one connection. In the client interface
-				//the connection will be stored as a single unique pointer, therefore we can't use the shared_from_this() to create a shared pointer for
-				//that info object.
+				//This is an important distinction because we want to enforce that a client can only have one connection, so the infos it
+				//receives never need to say which connection they came from.
 				else if (m_nOwnerType == owner::client)
 				{
-					std::cout << "Added incoming info to queue\n";
-					m_qInfosIn.push_back({ nullptr, m_infoTemporaryIn });
+					m_qInfosIn.push_back({ nullptr, std::move(m_infoTemporaryIn), nNow });
+				}
+
+			}
+
+			//Every handler holds one of these, so a connection that the server drops from its registry, or a client
+			//replaces in Reconnect(), isn't destroyed while one of its handlers is still waiting to run.
+			std::shared_ptr<Connection<T>> KeepAlive()
+			{
+				return this->weak_from_this().lock();
+			}
+
+			//Closes the socket after an error, a timeout or a call to Disconnect(). On the server it also queues a
+			//notice for Update(), which removes the connection from the server and calls OnClientDisconnect on the
+			//same thread as OnInfo. Only called on the io thread.
+			void Close()
+			{
+				m_timerHeartbeat.Cancel();
+				m_timerHandshake.Cancel();
+				m_timerStalledWrite.Cancel();
+				if (m_socket.is_open())
+					m_socket.close();
+
+				//Nothing still queued will be written now, so let anyone waiting in WriteInfo go
+				auto FailWaiters = [](threadsafeQueue<outgoing_info<T>>& q)
+				{
+					for (size_t i = 0; i < q.size(); i++)
+						if (q.at(i).pWaiter)
+							q.at(i).pWaiter->Complete(asio::error::not_connected);
+				};
+				for (auto& qLane : m_qLanes)
+					FailWaiters(qLane);
+				FailWaiters(m_qInfosOut);
+
+				if (m_pServer && !m_bCloseReported)
+				{
+					m_bCloseReported = true;
+					info<T> notice;
+					notice.header.id = reserved_ids<T>::connection_closed;
+					m_qInfosIn.push_back({ KeepAlive(), std::move(notice), SteadyNanoseconds() });
+				}
+				else if (m_nOwnerType == owner::client)
+				{
+					//A client application waiting on its inbound queue finds out from IsConnected()
+					m_qInfosIn.notify();
+				}
+			}
+
+			void StartHeartbeat()
+			{
+				m_nLastReceived = m_nLastActivity = SteadyNanoseconds();
+				//The first ping goes out straight away, so the round trip and clock offset are known within one
+				//round trip of connecting rather than after the first interval
+				if (m_heartbeat.interval.count() > 0)
+					SendHeartbeat(reserved_ids<T>::heartbeat_ping, m_nLastReceived);
+				ScheduleHeartbeat();
+			}
+
+			void ScheduleHeartbeat()
+			{
+				if (m_heartbeat.interval.count() > 0)
+					m_timerHeartbeat.Arm(m_heartbeat.interval);
+			}
+
+			//Every interval, check that the remote side is still there and send it a ping
+			void OnHeartbeatTimer()
+			{
+				if (!m_socket.is_open())
+					return;
+
+				uint64_t nNow = SteadyNanoseconds();
+				auto Expired = [nNow](uint64_t nSince, std::chrono::milliseconds timeout)
+				{
+					return timeout.count() > 0 &&
+						nNow - nSince > uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(timeout).count());
+				};
+
+				if (Expired(m_nLastReceived, m_heartbeat.deadTimeout))
+				{
+					//A half-open connection never reports an error of its own, this is the only way to notice
+					TL_NET_LOG_WARN(connection, "[{}] Remote stopped responding, closing", id);
+					Close();
+					return;
+				}
+
+				if (Expired(m_nLastActivity, m_heartbeat.idleTimeout))
+				{
+					TL_NET_LOG_INFO(connection, "[{}] Connection idle, closing", id);
+					Close();
+					return;
+				}
+
+				SendHeartbeat(reserved_ids<T>::heartbeat_ping, nNow);
+				ScheduleHeartbeat();
+			}
+
+			//A write that has made no progress for the stalled write timeout is given up on. It is re-armed when a
+			//write starts and again whenever part of it goes out, so a large batch draining slowly to a receiver
+			//that keeps up is left alone.
+			void ArmStalledWrite()
+			{
+				if (m_timeouts.stalledWrite.count() > 0)
+					m_timerStalledWrite.Arm(m_timeouts.stalledWrite);
+			}
+
+			//Completion condition for async_write: writes everything, and re-arms the stalled write timer after each
+			//partial write that moved some bytes.
+			auto WriteProgress()
+			{
+				return [this](const asio::error_code& ec, std::size_t nTransferred) -> std::size_t
+				{
+					if (!ec && nTransferred > 0)
+						ArmStalledWrite();
+					return asio::transfer_all()(ec, nTransferred);
+				};
+			}
+
+			void SendHeartbeat(T kind, uint64_t nTimestamp)
+			{
+				info<T> heartbeat;
+				heartbeat.header.id = kind;
+				heartbeat << nTimestamp;
+				Send(heartbeat, send_kind::reliable, send_lane::control);
+			}
+
+			//A ping is answered with its own timestamp and the times it arrived and the pong left, read from this
+			//side's clock. That is the NTP exchange:
+			//
+			//	 t0 ping sent (local)     t1 ping received (remote)
+			//	 t3 pong received (local) t2 pong sent (remote)
+			//
+			//	 round trip = (t3 - t0) - (t2 - t1)      offset = ((t1 - t0) + (t2 - t3)) / 2
+			//
+			//The offset is only exact when the ping and the pong took equally long, and a sample that was queued
+			//somewhere on the way has a longer round trip, so the offset is taken from the sample with the shortest
+			//round trip among the last few (NTP's clock filter). The round trip is smoothed the same way TCP smooths
+			//its RTT (RFC 6298): srtt moves 1/8 of the way to each sample, and the jitter 1/4 of the way to how far the
+			//sample was from srtt.
+			void OnHeartbeat(uint64_t nNow)
+			{
+				if (m_infoTemporaryIn.header.id == reserved_ids<T>::heartbeat_ping)
+				{
+					uint64_t t0 = 0;
+					if (m_infoTemporaryIn.body.size() == sizeof(t0))
+						m_infoTemporaryIn >> t0;
+
+					info<T> pong;
+					pong.header.id = reserved_ids<T>::heartbeat_pong;
+					pong << t0 << nNow << SteadyNanoseconds();
+					Send(pong, send_kind::reliable, send_lane::control);
+					return;
 				}
 
-				//Since the AddToIncomingInfoQueue() is called when are finished reading an info, so we will use this opportunity to register
-				//another task for the ASIO context to perform.
-				ReadHeader();
+				if (m_infoTemporaryIn.header.id != reserved_ids<T>::heartbeat_pong ||
+					m_infoTemporaryIn.body.size() != 3 * sizeof(uint64_t))
+					return;
+
+				uint64_t t0, t1, t2;
+				m_infoTemporaryIn >> t2 >> t1 >> t0;
+				uint64_t t3 = nNow;
+				if (t0 == 0 || t0 > t3 || t1 > t2)
+					return;
+
+				int64_t nSample = std::max<int64_t>(int64_t(t3 - t0) - int64_t(t2 - t1), 0);
+				int64_t nOffset = ((int64_t(t1) - int64_t(t0)) + (int64_t(t2) - int64_t(t3))) / 2;
 
+				m_vClockSamples[m_nClockSample++ % m_vClockSamples.size()] = { nSample, nOffset, true };
+				const clock_sample* pBest = nullptr;
+				for (const auto& sample : m_vClockSamples)
+					if (sample.bValid && (!pBest || sample.nRtt < pBest->nRtt))
+						pBest = &sample;
+				m_nClockOffset.store(pBest->nOffset, std::memory_order_relaxed);
+				m_bClockSynced.store(true, std::memory_order_release);
+
+				int64_t nRtt = int64_t(m_nSmoothedRtt.load(std::memory_order_relaxed));
+				int64_t nJitter = int64_t(m_nRttJitter.load(std::memory_order_relaxed));
+
+				if (nRtt == 0)
+				{
+					nRtt = nSample;
+					nJitter = nSample / 2;
+				}
+				else
+				{
+					nJitter += (std::abs(nRtt - nSample) - nJitter) / 4;
+					nRtt += (nSample - nRtt) / 8;
+				}
+
+				m_nSmoothedRtt.store(uint64_t(nRtt), std::memory_order_relaxed);
+				m_nRttJitter.store(uint64_t(nJitter), std::memory_order_relaxed);
 			}
 
 			// "Encrypt" data to be used for handsake
@@ -264,22 +1103,67 @@ namespace tl
 				return out ^ 0xC0DEFACE12345678;
 			}
 
+			//Infos are already gathered into batches before they are written, so holding small writes back as
+			//Nagle's algorithm does only adds latency. Only TCP has it, other transports ignore the option.
+			void SetNoDelay()
+			{
+				if (stream_socket* pSocket = m_socket.socket())
+				{
+					asio::error_code ec;
+					pSocket->set_option(asio::ip::tcp::no_delay(true), ec);
+				}
+			}
+
+			//The client end of the transport is connected, whichever transport it is
+			void OnConnected(asio::error_code ec)
+			{
+				if (ec)
+				{
+					TL_NET_LOG_WARN(connection, "Connect Fail: {}", ec.message());
+					Close();
+					return;
+				}
+
+				TL_NET_LOG_INFO(connection, "Connected to server");
+				SetNoDelay();
+				if (m_timeouts.handshake.count() > 0)
+					m_timerHandshake.Arm(m_timeouts.handshake);
+
+				//With a session to resume, present it straight away instead of waiting to be challenged
+				if (m_resumeToken.IsValid())
+				{
+					WriteResume();
+					return;
+				}
+
+				//First thing server will do is send packet to be validated
+				//so wait for that and respond
+				ReadValidation();
+			}
+
 			//ASYNC - Used by both the client and server to write validation packet
 			void WriteValidation()
 			{
-				std::cout << "sending validation code\n";
+				TL_NET_LOG_DEBUG(connection, "[{}] Sending validation code", id);
 				asio::async_write(m_socket, asio::buffer(&m_nHandshakeOut, sizeof(uint64_t)),
-					[this](std::error_code ec, std::size_t length)
+					[this, self = KeepAlive()](std::error_code ec, std::size_t length)
 					{
 						if (!ec)
 						{
 
 							if (m_nOwnerType == owner::client)
-								ReadHeader();
+								Establish();
+							else
+							{
+								//A verdict on a resume can only follow once the challenge is out of the way
+								m_bChallengeSent = true;
+								if (m_nResumeVerdict != 0)
+									WriteResumeVerdict();
+							}
 						}
 						else
 						{
-							m_socket.close();
+							Close();
 						}
 					}
 					);
@@ -288,7 +1172,7 @@ namespace tl
 			void ReadValidation(tl::net::server_interface<T>* server = nullptr)
 			{
 				asio::async_read(m_socket, asio::buffer(&m_nHandshakeIn, sizeof(uint64_t)),
-					[this, server](std::error_code ec, std::size_t length)
+					[this, self = KeepAlive(), server](std::error_code ec, std::size_t length)
 					{
 						if (!ec)
 						{
@@ -296,15 +1180,21 @@ namespace tl
 							{
 								if (m_nHandshakeIn == m_nHandshakeCheck)
 								{
-									std::cout << "Client Validated Successfully\n";
+									TL_NET_LOG_INFO(connection, "[{}] Client Validated Successfully", id);
 									server->OnClientValidated(this->shared_from_this());
 
-									ReadHeader();
+									SetSession(server->OpenSession(this->shared_from_this()));
+									Establish();
+								}
+								else if (m_nHandshakeIn == nResumeMagic && m_nResumeVerdict == 0)
+								{
+									//The client has a session to resume instead of an answer to the challenge
+									ReadResume(server);
 								}
 								else
 								{
-									std::cout << "Client Disconnected (Fail Validation)\n";
-									m_socket.close();
+									TL_NET_LOG_WARN(connection, "[{}] Client Disconnected (Fail Validation)", id);
+									Close();
 								}
 							}
 
@@ -317,31 +1207,275 @@ namespace tl
 						}
 						else
 						{
-							std::cout << "Client Disconnected (Read Validation)\n";
-							m_socket.close();
+							TL_NET_LOG_WARN(connection, "[{}] Client Disconnected (Read Validation)", id);
+							Close();
 						}
 					}
 					);
 			}
 
+			//The handshake is over, by validation or by resuming a session. Start reading, send whatever was queued
+			//meanwhile and, on the server, tell the client which session it has.
+			void Establish()
+			{
+				m_timerHandshake.Cancel();
+				m_bEstablished = true;
+
+				session_token token = GetSessionToken();
+				if (m_nOwnerType == owner::server && token.IsValid())
+				{
+					info<T> notice;
+					notice.header.id = reserved_ids<T>::session;
+					notice << token;
+					Send(std::move(notice), send_kind::reliable, send_lane::control);
+				}
+
+				StartHeartbeat();
+				StartReading();
+				if (!m_bWriting)
+					WriteInfos();
+			}
+
+			void SetSession(const session_token& token)
+			{
+				std::scoped_lock lock(m_muxSession);
+				m_session = token;
+			}
+
+			//Resuming a session instead of answering a challenge:
+			//
+			//	 Client                                         Server
+			//	   |--- resume marker, ID, secret ------------->|   sent as soon as TCP connects
+			//	   |<-- challenge, verdict ----------------------|   the challenge goes out on accept anyway
+			//	   |                                            |
+			//	 accepted: both sides carry on with the old ID and the server's state for it
+			//	 rejected: the client answers the challenge it was sent, as in a normal handshake
+			//
+			//Only called by clients
+			void WriteResume()
+			{
+				TL_NET_LOG_DEBUG(connection, "Resuming session {}", m_resumeToken.nID);
+				m_vResumeOut = { nResumeMagic, uint64_t(m_resumeToken.nID), m_resumeToken.nSecret };
+				asio::async_write(m_socket, asio::buffer(m_vResumeOut),
+					[this, self = KeepAlive()](std::error_code ec, std::size_t length)
+					{
+						if (ec)
+						{
+							Close();
+							return;
+						}
+
+						asio::async_read(m_socket, asio::buffer(m_vResumeIn),
+							[this, self = KeepAlive()](std::error_code ec, std::size_t length)
+							{
+								if (ec)
+								{
+									TL_NET_LOG_WARN(connection, "Resume Fail: {}", ec.message());
+									Close();
+								}
+								else if (m_vResumeIn[1] == nResumeAccepted)
+								{
+									TL_NET_LOG_INFO(connection, "Session {} resumed", m_resumeToken.nID);
+									m_bResumed.store(true, std::memory_order_release);
+									Establish();
+									//Nothing has come in yet, but whoever waits on the inbound queue can now see IsResumed()
+									m_qInfosIn.notify();
+								}
+								else
+								{
+									TL_NET_LOG_INFO(connection, "Session {} has expired, validating", m_resumeToken.nID);
+									m_nHandshakeOut = scramble(m_vResumeIn[0]);
+									WriteValidation();
+								}
+							});
+					});
+			}
+
+			//Only called by the server, once the resume marker has been read
+			void ReadResume(tl::net::server_interface<T>* server)
+			{
+				asio::async_read(m_socket, asio::buffer(m_vResumeIn),
+					[this, self = KeepAlive(), server](std::error_code ec, std::size_t length)
+					{
+						if (ec)
+						{
+							Close();
+							return;
+						}
+
+						session_token token;
+						token.nID = uint32_t(m_vResumeIn[0]);
+						token.nSecret = m_vResumeIn[1];
+
+						uint32_t nID = server->ResumeSession(this->shared_from_this(), token);
+						if (nID != 0)
+						{
+							id = nID;
+							token.nResumed = 1;
+							SetSession(token);
+							m_nResumeVerdict = nResumeAccepted;
+						}
+						else
+						{
+							m_nResumeVerdict = nResumeRejected;
+						}
+
+						if (m_bChallengeSent)
+							WriteResumeVerdict();
+					});
+			}
+
+			void WriteResumeVerdict()
+			{
+				asio::async_write(m_socket, asio::buffer(&m_nResumeVerdict, sizeof(m_nResumeVerdict)),
+					[this, self = KeepAlive()](std::error_code ec, std::size_t length)
+					{
+						if (ec)
+						{
+							Close();
+						}
+						else if (m_nResumeVerdict == nResumeAccepted)
+						{
+							TL_NET_LOG_INFO(connection, "[{}] Client Resumed Session", id);
+							m_pServer->OnClientResumed(this->shared_from_this());
+							Establish();
+						}
+						else
+						{
+							//Fall back to waiting for the answer to the challenge
+							ReadValidation(m_pServer);
+						}
+					});
+			}
+
+			//Only called by clients, when the server has told us our session
+			void OnSessionToken()
+			{
+				if (m_infoTemporaryIn.body.size() != sizeof(session_token))
+					return;
+
+				session_token token;
+				m_infoTemporaryIn >> token;
+				SetSession(token);
+			}
+
 		protected:
 			//Each connection has a unique socket to a remote
-			asio::ip::tcp::socket m_socket;
+			transport_stream m_socket;
 
 			//Sockets can't function without an IO context.
 			//This context is shared with the whole ASIO instance
 			asio::io_context& m_asioContext;
 
-			//This queue holds all infos to be sent to the remote side
-			//of this connection
-			threadsafeQueue<info<T>> m_qInfosOut;
+			//These queues hold all infos to be sent to the remote side
+			//of this connection, one per send_lane. Each entry is a reference,
+			//since a broadcast info is shared by the out queues of every connection.
+			static constexpr size_t nLanes = size_t(send_lane::automatic);
+			std::array<threadsafeQueue<outgoing_info<T>>, nLanes> m_qLanes;
+			//The infos taken from the lanes that are being written right now
+			threadsafeQueue<outgoing_info<T>> m_qInfosOut;
+			bool m_bWriting = false;
+
+			//Deficit round robin state for sharing between the interactive and bulk lanes
+			std::array<size_t, nLanes> m_nDeficit{};
+			std::array<uint32_t, nLanes> m_nLaneWeight{ 1, 4, 1 };
+			size_t m_nDrrLane = size_t(send_lane::interactive);
+			size_t m_nLastCharge = 0;
+			static constexpr size_t nLaneQuantum = 16 * 1024;
+
+			//Totals of everything in the lanes and m_qInfosOut, kept up to date by every thread that sends
+			std::atomic<size_t> m_nQueuedBytes{ 0 };
+			std::atomic<size_t> m_nQueuedInfos{ 0 };
+			std::atomic<bool> m_bCongested{ false };
+			send_watermarks m_watermarks;
+			backpressure_policy m_nBackpressurePolicy = backpressure_policy::drop_oldest;
+			//Producers held back by backpressure_policy::block wait here
+			std::mutex m_muxDrained;
+			std::condition_variable m_cvDrained;
+
+			//Only ever written by this connection's io thread
+			counter m_nBytesIn;
+			counter m_nBytesOut;
+			counter m_nInfosIn;
+			counter m_nInfosOut;
+
+			heartbeat_settings m_heartbeat;
+			timeout_settings m_timeouts;
+			//The timer wheel of the io_context this connection lives on, shared by every connection on it
+			timer_wheel& m_wheel;
+			wheel_timer m_timerHeartbeat;
+			wheel_timer m_timerHandshake;
+			wheel_timer m_timerStalledWrite;
+			//steady_clock times, only touched on the io thread. Anything received at all counts for m_nLastReceived,
+			//only infos other than heartbeats count for m_nLastActivity.
+			uint64_t m_nLastReceived = 0;
+			uint64_t m_nLastActivity = 0;
+			//Written on the io thread, read by anyone
+			std::atomic<uint64_t> m_nSmoothedRtt{ 0 };
+			std::atomic<uint64_t> m_nRttJitter{ 0 };
+			//The last few clock samples, only touched on the io thread
+			struct clock_sample
+			{
+				int64_t nRtt = 0;
+				int64_t nOffset = 0;
+				bool bValid = false;
+			};
+			std::array<clock_sample, 8> m_vClockSamples{};
+			size_t m_nClockSample = 0;
+			//Remote steady_clock minus local steady_clock, in nanoseconds. Written on the io thread, read by anyone.
+			std::atomic<int64_t> m_nClockOffset{ 0 };
+			std::atomic<bool> m_bClockSynced{ false };
+			bool m_bCloseReported = false;
+
+			//The session a client asks to resume, and the one the server has given this connection
+			session_token m_resumeToken;
+			session_token m_session;
+			mutable std::mutex m_muxSession;
+			std::atomic<bool> m_bResumed{ false };
+			std::atomic<bool> m_bDetached{ false };
+			//The resume exchange, see WriteResume(). Only touched on the io thread.
+			std::array<uint64_t, 3> m_vResumeOut{};
+			std::array<uint64_t, 2> m_vResumeIn{};
+			uint64_t m_nResumeVerdict = 0;
+			bool m_bChallengeSent = false;
+			//Set once the handshake is over, infos queued before that wait for it
+			bool m_bEstablished = false;
+			//Stands in for the answer to the challenge. An answer that happens to equal it is taken for a resume
+			//attempt, which then fails and leaves the client to validate again.
+			static constexpr uint64_t nResumeMagic = 0x4E4F495353455352;
+			static constexpr uint64_t nResumeAccepted = 1;
+			static constexpr uint64_t nResumeRejected = 2;
+
+			//The server that owns this connection, null on the client side
+			server_interface<T>* m_pServer = nullptr;
+
+			//How many file bytes of the info at the front of m_qInfosOut have been sent
+			uint32_t m_nFileBytesSent = 0;
+			//File bytes on their way to a transport sendfile() can't write to
+			std::vector<uint8_t> m_vFileBuffer;
+
+			//Buffer sequence for the batch currently being written, kept as a member so its storage is reused
+			std::vector<asio::const_buffer> m_vWriteBuffers;
+			size_t m_nMaxWriteBatchBytes = 64 * 1024;
+			//asio issues at most 64 buffers per writev(), so a batch of that many is still a single system call
+			static constexpr size_t nMaxWriteBuffers = 64;
 
 			//This queue holds all infos that have been received from
 			// the remote side of this connection. Note: it is a reference
 			// as the "owner" of this connection is expected to provide a
 			// queue
-			threadsafeQueue<owned_info<T>>& m_qInfosIn;
+			inbound_queue_t<T>& m_qInfosIn;
 			info<T> m_infoTemporaryIn;
+
+			//Receive buffer that each read fills as far as it can. Bytes between m_nReadStart and m_nReadEnd
+			//have been received but not yet parsed into infos.
+			std::vector<uint8_t> m_vReadBuffer;
+			size_t m_nReadStart = 0;
+			size_t m_nReadEnd = 0;
+			static constexpr size_t nReadBufferSize = 16 * 1024;
+			//Bodies at least this large skip the receive buffer. It must stay well below nReadBufferSize so that a
+			//smaller info always fits in the buffer once it has been compacted.
+			static constexpr size_t nDirectReadThreshold = 4 * 1024;
 			// The "owner" decides how some of the connection behaves
 			owner m_nOwnerType = owner::server;
 
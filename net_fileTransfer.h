@@ -0,0 +1,466 @@
+#ifndef NET_FILETRANSFER_H
+#define NET_FILETRANSFER_H
+/*
+	net_fileTransfer.h
+
+	A media file can be many gigabytes, but an info body is a single vector and header.size is only a uint32_t, so a
+	file can't simply be put into one info. Instead it is streamed as a sequence of infos:
+
+	   Sender                                                  Receiver
+	     |----- open  { transfer, size, chunk size, name } ------>|  receiver creates the file
+	     |----- chunk { transfer, offset } + data --------------->|  receiver writes data at offset
+	     |----- chunk { transfer, offset } + data --------------->|
+	     |<---- ack   { transfer, bytes written so far } ---------|
+	     |----- chunk ... ------------------------------------->  |
+	     |<---- ack   { transfer, file size, complete } ----------|  receiver closes the file
+
+	The sender reads each chunk from disk just before sending it and never has more than a window of chunks waiting for
+	an ack, and the receiver writes each chunk to disk as soon as it arrives. Both sides therefore use the same small
+	amount of memory for any size of file.
+
+	The info types used for open, chunk and ack are chosen by the application through file_transfer_ids, since T is
+	the application's own enum. Which kind of media is being sent (WEBM, MP4, FLV...) travels inside the open info.
+
+	The small fixed-size description of each info is pushed after the data, so that the receiver pops it off the end
+	with operator>> and is left with exactly the file data in the body.
+*/
+
+#include "net_base.h"
+#include "net_info.h"
+#include<fstream>
+#include<functional>
+#include<map>
+
+namespace tl
+{
+	namespace net
+	{
+		template<typename T>
+		struct file_transfer_ids
+		{
+			T open{};
+			T chunk{};
+			T ack{};
+		};
+
+		template<typename T>
+		struct file_open_info
+		{
+			uint32_t nTransferID = 0;
+			uint32_t nChunkSize = 0;
+			uint64_t nFileSize = 0;
+			//Where the sender will start sending from, 0 unless a transfer is being resumed
+			uint64_t nStartOffset = 0;
+			//The kind of media in the file, one of the application's info types
+			T mediaType{};
+			char szName[256]{};
+		};
+
+		struct file_chunk_info
+		{
+			uint32_t nTransferID = 0;
+			uint32_t nReserved = 0;
+			uint64_t nOffset = 0;
+		};
+
+		enum class file_ack_status : uint32_t
+		{
+			progress,
+			complete,
+			failed
+		};
+
+		struct file_ack_info
+		{
+			uint32_t nTransferID = 0;
+			file_ack_status status = file_ack_status::progress;
+			//Every byte before this offset has been written by the receiver
+			uint64_t nAckedBytes = 0;
+		};
+
+		//Streams one file at a time to the remote side. Chunks are only read from disk once there is room for them
+		//in the window, so memory use depends on nChunkSize * nWindowChunks, not on the size of the file.
+		template<typename T>
+		class file_sender
+		{
+			public:
+				//fnSend is given each info to keep, so it can pass it on with std::move and no chunk is ever copied
+				file_sender(file_transfer_ids<T> ids, std::function<void(info<T>&&)> fnSend,
+					uint32_t nChunkSize = 256 * 1024, uint32_t nWindowChunks = 8)
+					: m_ids(ids), m_fnSend(std::move(fnSend)), m_nChunkSize(nChunkSize), m_nWindowChunks(nWindowChunks)
+				{
+				}
+
+				//Hands each chunk over as a file region, for example to Connection::SendFile, instead of reading it into
+				//the body first. The data then goes from the page cache to the socket without being copied.
+				void SetSendFile(std::function<void(const info<T>&, std::shared_ptr<file_source>, uint64_t, uint32_t)> fnSendFile)
+				{
+					m_fnSendFile = std::move(fnSendFile);
+				}
+
+				//Starts streaming sPath. Returns false if the file can't be opened or a transfer is already running.
+				bool Open(const std::string& sPath, T mediaType, uint64_t nStartOffset = 0)
+				{
+					if (IsActive())
+						return false;
+
+					m_file.open(sPath, std::ios::binary | std::ios::ate);
+					if (!m_file.is_open())
+						return false;
+
+					if (m_fnSendFile)
+					{
+						m_pFileSource = file_source::Open(sPath);
+						if (!m_pFileSource)
+						{
+							Close();
+							return false;
+						}
+					}
+
+					m_nFileSize = uint64_t(m_file.tellg());
+					m_nNextOffset = std::min(nStartOffset, m_nFileSize);
+					m_nAckedBytes = m_nNextOffset;
+					m_nTransferID++;
+
+					m_open = {};
+					m_open.nTransferID = m_nTransferID;
+					m_open.nChunkSize = m_nChunkSize;
+					m_open.nFileSize = m_nFileSize;
+					m_open.nStartOffset = m_nNextOffset;
+					m_open.mediaType = mediaType;
+
+					//Only the file name is sent, never the directories it came from
+					std::string sName = sPath.substr(sPath.find_last_of("/\\") + 1);
+					sName.copy(m_open.szName, sizeof(m_open.szName) - 1);
+
+					SendOpen();
+					SendChunks();
+					return true;
+				}
+
+				//Carries on with the running transfer from the last byte the receiver acknowledged, after the
+				//connection was lost and a new one has resumed the session. Chunks sent but not acknowledged are
+				//sent again; the receiver still has everything before that. Returns false if there is no transfer.
+				bool Resume()
+				{
+					if (!IsActive())
+						return false;
+
+					m_nNextOffset = m_nAckedBytes;
+					m_open.nStartOffset = m_nAckedBytes;
+
+					SendOpen();
+					SendChunks();
+					return true;
+				}
+
+				//Pass every info received from the remote side through here. Returns true if it was an ack for this
+				//sender, in which case the window is refilled.
+				bool OnInfo(info<T>& info)
+				{
+					if (info.header.id != m_ids.ack || info.body.size() < sizeof(file_ack_info))
+						return false;
+
+					file_ack_info ack;
+					info >> ack;
+					if (ack.nTransferID != m_nTransferID || !IsActive())
+						return true;
+
+					if (ack.status == file_ack_status::failed)
+					{
+						Close();
+						return true;
+					}
+
+					//Acks only ever move forward, except when a resumed receiver holds less than it had acknowledged,
+					//e.g. because its partial file was lost. It then answers the open with what it does hold, and
+					//everything from there on is sent again.
+					if (ack.status == file_ack_status::progress && ack.nAckedBytes < m_nAckedBytes)
+						m_nNextOffset = m_nAckedBytes = ack.nAckedBytes;
+					else
+						m_nAckedBytes = std::max(m_nAckedBytes, ack.nAckedBytes);
+
+					if (ack.status == file_ack_status::complete)
+						Close();
+					else
+						SendChunks();
+
+					return true;
+				}
+
+				bool IsActive() const
+				{
+					return m_file.is_open();
+				}
+
+				uint64_t GetFileSize() const
+				{
+					return m_nFileSize;
+				}
+
+				uint64_t GetAckedBytes() const
+				{
+					return m_nAckedBytes;
+				}
+
+			protected:
+				void SendOpen()
+				{
+					info<T> info = make_info(m_ids.open, sizeof(m_open));
+					info << m_open;
+					m_fnSend(std::move(info));
+				}
+
+				//Reads and sends chunks until the window is full or the whole file has been sent
+				void SendChunks()
+				{
+					uint64_t nWindowBytes = uint64_t(m_nChunkSize) * m_nWindowChunks;
+
+					while (m_nNextOffset < m_nFileSize && m_nNextOffset - m_nAckedBytes < nWindowBytes)
+					{
+						size_t nLength = size_t(std::min<uint64_t>(m_nChunkSize, m_nFileSize - m_nNextOffset));
+
+						file_chunk_info chunk;
+						chunk.nTransferID = m_nTransferID;
+						chunk.nOffset = m_nNextOffset;
+
+						//Room for the chunk description as well, so pushing it after the data doesn't grow the body
+						info<T> info = make_info(m_ids.chunk, (m_pFileSource ? 0 : nLength) + sizeof(chunk));
+
+						if (m_pFileSource)
+						{
+							//The file region goes on the wire in front of the body, which is just the chunk description
+							info << chunk;
+							m_fnSendFile(info, m_pFileSource, m_nNextOffset, uint32_t(nLength));
+							m_nNextOffset += nLength;
+							continue;
+						}
+
+						//The read below fills all of it, or the transfer stops and the info is never sent
+						resize_uninitialized(info.body, nLength);
+
+						m_file.seekg(std::streamoff(m_nNextOffset));
+						if (!m_file.read(reinterpret_cast<char*>(info.body.data()), std::streamsize(nLength)))
+						{
+							Close();
+							return;
+						}
+
+						info << chunk;
+
+						m_fnSend(std::move(info));
+						m_nNextOffset += nLength;
+					}
+				}
+
+				void Close()
+				{
+					m_file.close();
+					m_file.clear();
+					//Chunks still queued for sending hold their own reference to the file
+					m_pFileSource.reset();
+				}
+
+				file_transfer_ids<T> m_ids;
+				std::function<void(info<T>&&)> m_fnSend;
+				std::function<void(const info<T>&, std::shared_ptr<file_source>, uint64_t, uint32_t)> m_fnSendFile;
+				std::shared_ptr<file_source> m_pFileSource;
+				uint32_t m_nChunkSize;
+				uint32_t m_nWindowChunks;
+
+				std::ifstream m_file;
+				uint32_t m_nTransferID = 0;
+				//Describes the running transfer, sent again by Resume()
+				file_open_info<T> m_open;
+				uint64_t m_nFileSize = 0;
+				//The next byte of the file to be sent
+				uint64_t m_nNextOffset = 0;
+				//Every byte before this has been acknowledged by the receiver
+				uint64_t m_nAckedBytes = 0;
+		};
+
+		//Writes the files streamed by one remote side into a directory. Several transfers may be open at once.
+		template<typename T>
+		class file_receiver
+		{
+			public:
+				struct transfer
+				{
+					std::string sPath;
+					T mediaType{};
+					uint64_t nFileSize = 0;
+					uint64_t nReceivedBytes = 0;
+					//Chunks since the last progress ack, counted per transfer so each one is acked as often
+					uint32_t nChunksSinceAck = 0;
+					//Set when a resume asked for more than we have. Chunks the sender sent before it rewound are
+					//then skipped until the one we asked for arrives.
+					bool bRewinding = false;
+					std::ofstream file;
+				};
+
+				//nAckEveryChunks must be below the sender's window, or the sender would stop and wait for an ack
+				//that is never sent.
+				file_receiver(file_transfer_ids<T> ids, std::string sDirectory, uint32_t nAckEveryChunks = 4)
+					: m_ids(ids), m_sDirectory(std::move(sDirectory)), m_nAckEveryChunks(std::max<uint32_t>(nAckEveryChunks, 1))
+				{
+				}
+
+				//Pass every info received from the sender through here, along with a callable that sends an info
+				//back to it. Returns true if the info belonged to a file transfer.
+				template<typename Reply>
+				bool OnInfo(info<T>& info, Reply&& fnReply)
+				{
+					if (info.header.id == m_ids.open && info.body.size() >= sizeof(file_open_info<T>))
+					{
+						file_open_info<T> open;
+						info >> open;
+						OnOpen(open, fnReply);
+						return true;
+					}
+
+					if (info.header.id == m_ids.chunk && info.body.size() >= sizeof(file_chunk_info))
+					{
+						file_chunk_info chunk;
+						info >> chunk;
+						OnChunk(chunk, info, fnReply);
+						return true;
+					}
+
+					return false;
+				}
+
+				//Called when a file has been received completely
+				std::function<void(const transfer&)> OnFileReceived;
+
+			protected:
+				template<typename Reply>
+				void OnOpen(file_open_info<T>& open, Reply& fnReply)
+				{
+					open.szName[sizeof(open.szName) - 1] = '\0';
+					std::string sName(open.szName);
+
+					//Never let the remote side pick a path outside our directory
+					sName = sName.substr(sName.find_last_of("/\\") + 1);
+					if (sName.empty() || sName == "." || sName == "..")
+						sName = "transfer_" + std::to_string(open.nTransferID);
+
+					transfer& t = m_mapTransfers[open.nTransferID];
+					t.sPath = m_sDirectory + "/" + sName;
+					t.mediaType = open.mediaType;
+					t.nFileSize = open.nFileSize;
+					t.nReceivedBytes = open.nStartOffset;
+					t.nChunksSinceAck = 0;
+					t.bRewinding = false;
+					t.file.close();
+					t.file.clear();
+
+					//A transfer that doesn't start at 0 continues a file we already have part of. If that file is gone
+					//it is started again, and the sender is rewound to 0 below.
+					if (open.nStartOffset > 0)
+						t.file.open(t.sPath, std::ios::binary | std::ios::in | std::ios::out);
+					if (!t.file.is_open())
+						t.file.open(t.sPath, std::ios::binary | std::ios::trunc);
+
+					if (!t.file.is_open())
+					{
+						SendAck(open.nTransferID, file_ack_status::failed, 0, fnReply);
+						m_mapTransfers.erase(open.nTransferID);
+						return;
+					}
+
+					//The remote can only tell us where it would like to carry on from; what we hold is what is in the
+					//file. The sender is told where that is and rewinds to it.
+					if (open.nStartOffset > 0)
+					{
+						t.file.seekp(0, std::ios::end);
+						uint64_t nHeld = std::min<uint64_t>(uint64_t(std::max<std::streamoff>(t.file.tellp(), 0)), t.nFileSize);
+						t.bRewinding = nHeld < t.nReceivedBytes;
+						t.nReceivedBytes = std::min(t.nReceivedBytes, nHeld);
+						SendAck(open.nTransferID, file_ack_status::progress, t.nReceivedBytes, fnReply);
+					}
+
+					if (t.nReceivedBytes >= t.nFileSize)
+						Complete(open.nTransferID, t, fnReply);
+				}
+
+				template<typename Reply>
+				void OnChunk(const file_chunk_info& chunk, info<T>& info, Reply& fnReply)
+				{
+					auto it = m_mapTransfers.find(chunk.nTransferID);
+					if (it == m_mapTransfers.end())
+						return;
+
+					transfer& t = it->second;
+
+					if (t.bRewinding)
+					{
+						if (chunk.nOffset != t.nReceivedBytes)
+							return;
+						t.bRewinding = false;
+					}
+
+					//Chunks of one transfer arrive in order over the connection, so anything that doesn't carry on
+					//exactly where the last one ended, or runs past the end of the file, is refused. Otherwise the
+					//remote could write anywhere in the file, or leave a hole and have the transfer count as done.
+					if (chunk.nOffset != t.nReceivedBytes || info.body.size() > t.nFileSize - t.nReceivedBytes)
+					{
+						SendAck(chunk.nTransferID, file_ack_status::failed, t.nReceivedBytes, fnReply);
+						m_mapTransfers.erase(it);
+						return;
+					}
+
+					t.file.seekp(std::streamoff(chunk.nOffset));
+					if (!t.file.write(reinterpret_cast<const char*>(info.body.data()), std::streamsize(info.body.size())))
+					{
+						SendAck(chunk.nTransferID, file_ack_status::failed, t.nReceivedBytes, fnReply);
+						m_mapTransfers.erase(it);
+						return;
+					}
+
+					t.nReceivedBytes += info.body.size();
+
+					if (t.nReceivedBytes >= t.nFileSize)
+						Complete(chunk.nTransferID, t, fnReply);
+					else if (++t.nChunksSinceAck >= m_nAckEveryChunks)
+					{
+						t.nChunksSinceAck = 0;
+						SendAck(chunk.nTransferID, file_ack_status::progress, t.nReceivedBytes, fnReply);
+					}
+				}
+
+				template<typename Reply>
+				void Complete(uint32_t nTransferID, transfer& t, Reply& fnReply)
+				{
+					t.file.close();
+					SendAck(nTransferID, file_ack_status::complete, t.nReceivedBytes, fnReply);
+
+					if (OnFileReceived)
+						OnFileReceived(t);
+
+					m_mapTransfers.erase(nTransferID);
+				}
+
+				template<typename Reply>
+				void SendAck(uint32_t nTransferID, file_ack_status status, uint64_t nAckedBytes, Reply& fnReply)
+				{
+					file_ack_info ack;
+					ack.nTransferID = nTransferID;
+					ack.status = status;
+					ack.nAckedBytes = nAckedBytes;
+
+					info<T> info;
+					info.header.id = m_ids.ack;
+					info << ack;
+					fnReply(info);
+				}
+
+				file_transfer_ids<T> m_ids;
+				std::string m_sDirectory;
+				uint32_t m_nAckEveryChunks;
+				std::map<uint32_t, transfer> m_mapTransfers;
+		};
+	}
+}
+
+#endif
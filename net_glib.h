@@ -0,0 +1,79 @@
+#ifndef NET_GLIB_H
+#define NET_GLIB_H
+/*
+	net_glib.h
+
+	Lets a GLib (and so GTK) main loop dispatch a client's infos and user commands, on the same thread as the
+	window, instead of a second loop polling the queues:
+
+	   GLib main loop
+	     |-- poll() on the window's descriptors and on client_interface::Ready() --- sleeps, no CPU
+	     |-- button clicked  -> addToUserCommands() -> Ready() becomes readable
+	     |-- info arrives    -> Incoming()          -> Ready() becomes readable
+	     |-- readiness source dispatched: Clear(), then fn drains both queues
+
+	Not included by tl_net.h, so that only applications that use GLib need it.
+*/
+
+#include "net_readiness.hpp"
+#include <functional>
+#include <glib.h>
+
+namespace tl
+{
+	namespace net
+	{
+		//A GSource watching a readiness_event. GLib allocates it with g_source_new, so the members after the
+		//GSource are constructed and destroyed by hand.
+		struct readiness_source
+		{
+			GSource source;
+			readiness_event* pEvent;
+			std::function<void()> fnDispatch;
+
+			static gboolean Dispatch(GSource* pSource, GSourceFunc, gpointer)
+			{
+				readiness_source* p = reinterpret_cast<readiness_source*>(pSource);
+				p->pEvent->Clear();
+				p->fnDispatch();
+				return G_SOURCE_CONTINUE;
+			}
+
+			static void Finalize(GSource* pSource)
+			{
+				reinterpret_cast<readiness_source*>(pSource)->fnDispatch.~function();
+			}
+		};
+
+		//Makes a source that calls fn on the thread running its GMainContext each time event has been notified.
+		//The event is cleared before fn is called, so fn should drain everything the event stands for. With no
+		//prepare or check function GLib only wakes up for the event's descriptor, there is no timeout or polling.
+		inline GSource* MakeReadinessSource(readiness_event& event, std::function<void()> fn)
+		{
+			static GSourceFuncs funcs = { nullptr, nullptr, &readiness_source::Dispatch, &readiness_source::Finalize,
+				nullptr, nullptr };
+
+			GSource* pSource = g_source_new(&funcs, sizeof(readiness_source));
+			readiness_source* p = reinterpret_cast<readiness_source*>(pSource);
+			p->pEvent = &event;
+			new (&p->fnDispatch) std::function<void()>(std::move(fn));
+
+			g_source_add_unix_fd(pSource, event.GetFd(), G_IO_IN);
+			g_source_set_name(pSource, "tl::net readiness");
+			return pSource;
+		}
+
+		//Attaches a readiness source to context (the default main context if null) and returns its ID, e.g. for
+		//g_source_remove. fn is called once on the first iteration, so anything queued before is not missed.
+		inline guint AttachReadiness(readiness_event& event, std::function<void()> fn, GMainContext* pContext = nullptr)
+		{
+			GSource* pSource = MakeReadinessSource(event, std::move(fn));
+			guint nID = g_source_attach(pSource, pContext);
+			g_source_unref(pSource);
+			event.Notify();
+			return nID;
+		}
+	}
+}
+
+#endif
@@ -1,6 +1,9 @@
 #ifndef NET_DATA_H
 #define NET_DATA_H
 #include "net_base.h"
+#include "net_threadsafeQueue.hpp"
+#include "net_mpscQueue.hpp"
+#include "net_bufferPool.hpp"
 
 namespace tl
 {
@@ -20,7 +23,8 @@ namespace tl
 		{
 			public:
 			info_header<T> header{};
-			std::vector<uint8_t> body;
+			//Bodies are drawn from, and returned to, the size-classed buffer_pool instead of the heap
+			std::vector<uint8_t, pool_allocator<uint8_t>> body;
 
 			/*size_t size() const
 			{
@@ -111,6 +115,243 @@ namespace tl
 
 		};
 
+		//An info that has been handed over for sending. It can no longer change, so the same one can sit in the out
+		//queue of any number of connections at once: a broadcast allocates and fills the header and body a single
+		//time and every connection just holds another reference to it.
+		template <typename T>
+		using shared_info = std::shared_ptr<const info<T>>;
+
+		template <typename T>
+		shared_info<T> make_shared_info(const info<T>& info)
+		{
+			return std::make_shared<const tl::net::info<T>>(info);
+		}
+
+		//Takes the body over instead of copying it. This is how an info passed to Send as an rvalue reaches the
+		//out queue without its payload ever being copied.
+		template <typename T>
+		shared_info<T> make_shared_info(info<T>&& info)
+		{
+			return std::make_shared<const tl::net::info<T>>(std::move(info));
+		}
+
+		//Starts an info with room for nReserveBytes of body, so filling it with operator<< or by writing into body
+		//never has to grow it. A large payload can be built in place this way and then handed to Send with
+		//std::move:
+		//
+		//	auto chunk = make_info(CustomInfoTypes::FILE_CHUNK, nBytes + sizeof(file_chunk_info));
+		//	chunk.body.resize(nBytes);
+		//	file.read(reinterpret_cast<char*>(chunk.body.data()), nBytes);
+		//	chunk << chunkInfo;
+		//	client.Send(std::move(chunk));
+		template <typename T>
+		info<T> make_info(T id, size_t nReserveBytes = 0)
+		{
+			info<T> out;
+			out.header.id = id;
+			out.body.reserve(nReserveBytes);
+			return out;
+		}
+
+		//An open file that infos can be sent from without reading it into memory first. The descriptor is closed once
+		//the last reference goes, so a file stays open for exactly as long as sends from it are queued.
+		class file_source
+		{
+		public:
+			explicit file_source(int fd) : fd(fd)
+			{
+			}
+
+			file_source(const file_source&) = delete;
+
+			~file_source()
+			{
+				if (fd >= 0)
+					::close(fd);
+			}
+
+			//Opens sPath for reading. Returns nullptr if it can't be opened.
+			static std::shared_ptr<file_source> Open(const std::string& sPath)
+			{
+				int fd = ::open(sPath.c_str(), O_RDONLY | O_CLOEXEC);
+				if (fd < 0)
+					return nullptr;
+				return std::make_shared<file_source>(fd);
+			}
+
+			const int fd;
+		};
+
+		//How an info may be treated when the connection it is queued on falls behind
+		enum class send_kind : uint8_t
+		{
+			//Always delivered
+			reliable,
+			//May be dropped, for example a media frame that will be out of date by the time it arrives
+			droppable,
+			//Only the newest queued info with the same id matters, for example the current play position
+			state
+		};
+
+		//Each connection has one queue per lane. Whenever the socket is ready for more, anything in the control lane
+		//goes first. The interactive and bulk lanes share what is left by weight, and at most one bulk info is
+		//written at a time, so a control info never waits behind more than one bulk info.
+		enum class send_lane : uint8_t
+		{
+			control,
+			interactive,
+			bulk,
+			//Let info_lane<T> decide from the id of the info
+			automatic
+		};
+
+		//Chooses the lane of an info sent with send_lane::automatic. By default everything is interactive.
+		//Specialise it to sort the application's info types into lanes:
+		//
+		//	template<>
+		//	struct tl::net::info_lane<MyInfoTypes>
+		//	{
+		//		static tl::net::send_lane Of(MyInfoTypes id)
+		//		{
+		//			return id == MyInfoTypes::MEDIA_CHUNK ? tl::net::send_lane::bulk : tl::net::send_lane::control;
+		//		}
+		//	};
+		template <typename T>
+		struct info_lane
+		{
+			static send_lane Of(T id)
+			{
+				return send_lane::interactive;
+			}
+		};
+
+		//What a connection does once more than the high watermark of bytes or infos is queued for sending
+		enum class backpressure_policy : uint8_t
+		{
+			//Make the thread calling Send wait until the queue has drained to the low watermark
+			block,
+			//Drop the oldest droppable infos until the queue is back down to the low watermark
+			drop_oldest,
+			//Drop every state info that has a newer one with the same id queued behind it
+			coalesce,
+			//Give up on the remote side
+			disconnect
+		};
+
+		struct send_watermarks
+		{
+			size_t nHighBytes = 64 * 1024 * 1024;
+			size_t nLowBytes = 16 * 1024 * 1024;
+			size_t nHighInfos = 64 * 1024;
+			size_t nLowInfos = 16 * 1024;
+		};
+
+		//The highest values of T's underlying type are reserved for infos the library sends itself. They are handled
+		//inside Connection and the server, and never reach OnInfo, so an info type must not use them.
+		template <typename T>
+		struct reserved_ids
+		{
+			using underlying = std::underlying_type_t<T>;
+
+			//Sent by both sides every heartbeat interval, carrying the sender's steady_clock time
+			static constexpr T heartbeat_ping = T(std::numeric_limits<underlying>::max());
+			//The reply to a ping, carrying the ping's time back so the sender can measure the round trip
+			static constexpr T heartbeat_pong = T(std::numeric_limits<underlying>::max() - 1);
+			//Put in the server's inbound queue by a connection that has closed, never sent on the wire
+			static constexpr T connection_closed = T(std::numeric_limits<underlying>::max() - 2);
+			//Sent by the server once a client is validated or resumed, carrying the session_token to resume with
+			static constexpr T session = T(std::numeric_limits<underlying>::max() - 3);
+
+			static constexpr bool IsReserved(T id)
+			{
+				return underlying(id) >= underlying(session);
+			}
+		};
+
+		//What a client presents to get its old session back after its connection dropped: the same ID, and the
+		//server's per-client state such as half-received files, without the validation round trip. nSecret is 0 for
+		//no session.
+		struct session_token
+		{
+			uint32_t nID = 0;
+			//Non-zero when the server sent this token because a session was resumed
+			uint32_t nResumed = 0;
+			uint64_t nSecret = 0;
+
+			bool IsValid() const
+			{
+				return nSecret != 0;
+			}
+		};
+
+		//How often a connection checks on its remote side, and when it gives up. A timeout of zero turns it off.
+		struct heartbeat_settings
+		{
+			//A ping goes out this often, which keeps the RTT estimate fresh and shows the remote we are alive
+			std::chrono::milliseconds interval{ 1000 };
+			//Nothing at all received for this long, not even a pong, and the remote is taken to be dead
+			std::chrono::milliseconds deadTimeout{ 5000 };
+			//No infos other than heartbeats sent or received for this long, and the connection is closed as idle
+			std::chrono::milliseconds idleTimeout{ 0 };
+		};
+
+		//Deadlines for the parts of a connection that wait on the remote side. A timeout of zero turns it off.
+		struct timeout_settings
+		{
+			//The remote has this long to complete the validation handshake
+			std::chrono::milliseconds handshake{ 5000 };
+			//A write to the socket may go this long without finishing before the connection is given up on
+			std::chrono::milliseconds stalledWrite{ 30000 };
+		};
+
+		//Lets a coroutine waiting in Connection::WriteInfo find out when its info has left. It lives in the waiting
+		//coroutine's frame, so nothing is allocated for it, and is only touched on the connection's io thread.
+		struct write_waiter
+		{
+			explicit write_waiter(const asio::any_io_executor& executor)
+				: timer(executor, asio::steady_timer::time_point::max())
+			{
+			}
+
+			//Cancelled to wake the waiter once bDone is set
+			asio::steady_timer timer;
+			asio::error_code ec;
+			bool bDone = false;
+
+			void Complete(asio::error_code result)
+			{
+				if (bDone)
+					return;
+				bDone = true;
+				ec = result;
+				timer.cancel();
+			}
+		};
+
+		//One entry of a connection's out queue. What goes on the wire is the header of pInfo, then nFileLength bytes
+		//of pFile starting at nFileOffset, then the body of pInfo. Without a file it is simply the info.
+		template <typename T>
+		struct outgoing_info
+		{
+			shared_info<T> pInfo;
+
+			std::shared_ptr<file_source> pFile;
+			uint64_t nFileOffset = 0;
+			uint32_t nFileLength = 0;
+
+			send_kind kind = send_kind::reliable;
+			send_lane lane = send_lane::interactive;
+
+			//Told when the entry has been written, or that it never will be. Null for everything but WriteInfo.
+			write_waiter* pWaiter = nullptr;
+
+			//Bytes this entry puts on the wire
+			size_t Bytes() const
+			{
+				return sizeof(info_header<T>) + pInfo->body.size() + nFileLength;
+			}
+		};
+
 		//Forward declare the connection
 		template<typename T>
 		class Connection;
@@ -127,6 +368,10 @@ namespace tl
 			
 			info<T> info_;
 
+			//steady_clock time in nanoseconds at which the info was put in the inbound queue, so the consumer can
+			//tell how long it waited there
+			uint64_t nQueuedAt = 0;
+
 			friend std::ostream& operator<<(std::ostream& os, const owned_info<T>& info)
 			{
 				os << info.info_;
@@ -135,6 +380,24 @@ namespace tl
 			
 		};
 
+		//Selects the queue used on the receive path, that is server_interface::m_qInfosIn, client_interface::m_qInfosIn
+		//and the reference every Connection holds to it. By default it is the lock free mpscQueue. To go back to the
+		//mutex based threadsafeQueue for a given info type, for example to benchmark the two side by side, specialise it:
+		//
+		//	template<>
+		//	struct tl::net::inbound_queue<MyInfoTypes>
+		//	{
+		//		using type = tl::net::threadsafeQueue<tl::net::owned_info<MyInfoTypes>>;
+		//	};
+		template <typename T>
+		struct inbound_queue
+		{
+			using type = mpscQueue<owned_info<T>>;
+		};
+
+		template <typename T>
+		using inbound_queue_t = typename inbound_queue<T>::type;
+
 
 
 	}
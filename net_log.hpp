@@ -0,0 +1,417 @@
+#ifndef NET_LOG_HPP
+#define NET_LOG_HPP
+/*
+	net_log.hpp
+
+	Writing to std::cout from an io thread takes the stream's lock, formats the text and, with std::endl, flushes it
+	to the terminal, all before the thread can get back to its socket. Once a few infos per second become thousands,
+	that is where the time goes.
+
+	The logger splits the work in two:
+
+	 io thread 1 --> | rec | rec | rec |   |   |     ring per thread, fixed size binary records
+	 io thread 2 --> | rec |   |   |   |   |   |     no locks, no formatting, no system calls
+	 Update()    --> | rec | rec |   |   |   |   |
+	                        \      |      /
+	                         v     v     v
+	                        writer thread              formats the records and writes them out
+
+	- A record is the format string (which must be a string literal, only its address is stored), the level, the
+	  category, a timestamp and up to nMaxArgs arguments. Numbers are stored as they are, strings are copied into the
+	  record and cut short if they don't fit.
+	- Each thread writes only to its own ring and the writer thread only reads from it, so a ring needs no more than
+	  two atomic positions. If the writer falls behind and a ring is full the record is dropped and counted rather
+	  than making the network thread wait.
+	- The format string uses {} for each argument, e.g.
+	      TL_NET_LOG_INFO(connection, "[{}] Connection Approved", nID);
+
+	Levels below TL_NET_LOG_LEVEL are removed by the compiler, arguments and all, so trace logging on the per-info
+	paths costs nothing unless it is compiled in. Build with -DTL_NET_LOG_LEVEL=0 to keep everything.
+	Above that, SetLevel() and SetCategory() filter at runtime.
+*/
+
+#include "net_base.h"
+#include <condition_variable>
+#include <cstring>
+#include <string_view>
+
+//0 trace, 1 debug, 2 info, 3 warn, 4 error, 5 nothing at all
+#ifndef TL_NET_LOG_LEVEL
+#define TL_NET_LOG_LEVEL 2
+#endif
+
+namespace tl
+{
+	namespace net
+	{
+		enum class log_level : uint8_t
+		{
+			trace,
+			debug,
+			info,
+			warn,
+			error,
+			off
+		};
+
+		enum class log_category : uint8_t
+		{
+			general,
+			server,
+			client,
+			connection,
+			transfer,
+			count
+		};
+
+		class logger
+		{
+			public:
+				static constexpr size_t nMaxArgs = 6;
+				static constexpr size_t nMaxText = 120;
+				static constexpr size_t nRingRecords = 1024;
+
+				//Runtime filter on top of the compile-time one
+				static void SetLevel(log_level level)
+				{
+					Get().m_nLevel.store(uint8_t(level), std::memory_order_relaxed);
+				}
+
+				static void SetCategory(log_category category, bool bEnabled)
+				{
+					uint32_t nBit = 1u << uint32_t(category);
+					if (bEnabled)
+						Get().m_nCategories.fetch_or(nBit, std::memory_order_relaxed);
+					else
+						Get().m_nCategories.fetch_and(~nBit, std::memory_order_relaxed);
+				}
+
+				//Where the writer thread sends its lines. Defaults to std::cout. The stream is only ever touched by
+				//the writer thread.
+				static void SetOutput(std::ostream& os)
+				{
+					std::scoped_lock lock(Get().m_muxWriter);
+					Get().m_pOutput = &os;
+				}
+
+				static bool Enabled(log_level level, log_category category)
+				{
+					logger& l = Get();
+					return uint8_t(level) >= l.m_nLevel.load(std::memory_order_relaxed) &&
+						(l.m_nCategories.load(std::memory_order_relaxed) & (1u << uint32_t(category)));
+				}
+
+				//Records dropped because a ring was full
+				static uint64_t GetDropped()
+				{
+					return Get().m_nDropped.load(std::memory_order_relaxed);
+				}
+
+				//Blocks until everything logged so far has been written out
+				static void Flush()
+				{
+					logger& l = Get();
+					std::unique_lock lock(l.m_muxWriter);
+					uint64_t nTarget = l.m_nSweeps + 2;
+					l.m_cvWake.notify_one();
+					l.m_cvSwept.wait(lock, [&] { return l.m_nSweeps >= nTarget || !l.m_bRunning; });
+				}
+
+				template<typename... Args>
+				static void Write(log_level level, log_category category, const char* szFormat, const Args&... args)
+				{
+					static_assert(sizeof...(Args) <= nMaxArgs, "Too many arguments for one log record");
+
+					ring& r = LocalRing();
+					record* pRecord = r.Claim();
+					if (!pRecord)
+					{
+						Get().m_nDropped.fetch_add(1, std::memory_order_relaxed);
+						return;
+					}
+
+					pRecord->nTime = uint64_t(std::chrono::duration_cast<std::chrono::microseconds>(
+						std::chrono::system_clock::now().time_since_epoch()).count());
+					pRecord->szFormat = szFormat;
+					pRecord->level = level;
+					pRecord->category = category;
+					pRecord->nArgs = 0;
+					pRecord->nTextUsed = 0;
+					(Capture(*pRecord, args), ...);
+
+					r.Publish();
+				}
+
+			protected:
+				struct arg
+				{
+					enum class kind : uint8_t { i, u, d, s } type;
+					union
+					{
+						int64_t i;
+						uint64_t u;
+						double d;
+						struct { uint16_t nOffset; uint16_t nLength; } s;
+					};
+				};
+
+				struct record
+				{
+					uint64_t nTime;
+					const char* szFormat;
+					log_level level;
+					log_category category;
+					uint8_t nArgs;
+					uint8_t nTextUsed;
+					std::array<arg, nMaxArgs> args;
+					char szText[nMaxText];
+				};
+
+				//Single producer (the owning thread), single consumer (the writer thread)
+				struct ring
+				{
+					std::array<record, nRingRecords> records;
+					alignas(64) std::atomic<size_t> nHead{ 0 };
+					alignas(64) std::atomic<size_t> nTail{ 0 };
+					uint32_t nThread = 0;
+					std::atomic<bool> bRetired{ false };
+
+					record* Claim()
+					{
+						size_t nH = nHead.load(std::memory_order_relaxed);
+						if (nH - nTail.load(std::memory_order_acquire) == nRingRecords)
+							return nullptr;
+						return &records[nH % nRingRecords];
+					}
+
+					void Publish()
+					{
+						nHead.store(nHead.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+					}
+				};
+
+				//Keeps the ring alive until the writer has drained it, even after its thread has exited
+				struct ring_owner
+				{
+					std::shared_ptr<ring> pRing;
+
+					ring_owner() : pRing(std::make_shared<ring>())
+					{
+						Get().Register(pRing);
+					}
+
+					~ring_owner()
+					{
+						pRing->bRetired.store(true, std::memory_order_release);
+					}
+				};
+
+				template<typename A>
+				static void Capture(record& rec, const A& a)
+				{
+					arg& x = rec.args[rec.nArgs++];
+					if constexpr (std::is_enum_v<A>)
+					{
+						x.type = arg::kind::i;
+						x.i = int64_t(a);
+					}
+					else if constexpr (std::is_floating_point_v<A>)
+					{
+						x.type = arg::kind::d;
+						x.d = double(a);
+					}
+					else if constexpr (std::is_integral_v<A> && std::is_signed_v<A>)
+					{
+						x.type = arg::kind::i;
+						x.i = int64_t(a);
+					}
+					else if constexpr (std::is_integral_v<A>)
+					{
+						x.type = arg::kind::u;
+						x.u = uint64_t(a);
+					}
+					else
+					{
+						//Anything else has to be some kind of string
+						std::string_view sv(a);
+						size_t nLength = std::min(sv.size(), nMaxText - rec.nTextUsed);
+						std::memcpy(rec.szText + rec.nTextUsed, sv.data(), nLength);
+						x.type = arg::kind::s;
+						x.s.nOffset = rec.nTextUsed;
+						x.s.nLength = uint16_t(nLength);
+						rec.nTextUsed += uint8_t(nLength);
+					}
+				}
+
+				static logger& Get()
+				{
+					static logger l;
+					return l;
+				}
+
+				static ring& LocalRing()
+				{
+					thread_local ring_owner owner;
+					return *owner.pRing;
+				}
+
+				logger()
+				{
+					m_thread = std::thread([this] { Run(); });
+				}
+
+				~logger()
+				{
+					{
+						std::scoped_lock lock(m_muxWriter);
+						m_bRunning = false;
+					}
+					m_cvWake.notify_one();
+					if (m_thread.joinable())
+						m_thread.join();
+				}
+
+				void Register(std::shared_ptr<ring> pRing)
+				{
+					std::scoped_lock lock(m_muxRings);
+					pRing->nThread = m_nNextThread++;
+					m_vRings.push_back(std::move(pRing));
+				}
+
+				//Writer thread. Sweeps every ring, then sleeps a little. Producers never wake it, which is what keeps
+				//them free of system calls.
+				void Run()
+				{
+					std::string sLine;
+					std::unique_lock lock(m_muxWriter);
+					for (;;)
+					{
+						bool bRunning = m_bRunning;
+						lock.unlock();
+
+						std::vector<std::shared_ptr<ring>> vRings;
+						{
+							std::scoped_lock lockRings(m_muxRings);
+							vRings = m_vRings;
+						}
+
+						std::string sOut;
+						for (auto& pRing : vRings)
+							Drain(*pRing, sLine, sOut);
+
+						lock.lock();
+						if (!sOut.empty())
+						{
+							m_pOutput->write(sOut.data(), std::streamsize(sOut.size()));
+							m_pOutput->flush();
+						}
+
+						//A ring whose thread has gone and which was empty before this sweep can go too
+						{
+							std::scoped_lock lockRings(m_muxRings);
+							m_vRings.erase(std::remove_if(m_vRings.begin(), m_vRings.end(), [](const auto& p)
+								{
+									return p->bRetired.load(std::memory_order_acquire) &&
+										p->nTail.load(std::memory_order_relaxed) == p->nHead.load(std::memory_order_acquire);
+								}), m_vRings.end());
+						}
+
+						m_nSweeps++;
+						m_cvSwept.notify_all();
+
+						if (!bRunning)
+							break;
+						m_cvWake.wait_for(lock, std::chrono::milliseconds(5));
+					}
+				}
+
+				void Drain(ring& r, std::string& sLine, std::string& sOut)
+				{
+					size_t nTail = r.nTail.load(std::memory_order_relaxed);
+					size_t nHead = r.nHead.load(std::memory_order_acquire);
+					for (; nTail != nHead; nTail++)
+					{
+						Format(r.records[nTail % nRingRecords], r.nThread, sLine);
+						sOut += sLine;
+					}
+					r.nTail.store(nTail, std::memory_order_release);
+				}
+
+				static void Format(const record& rec, uint32_t nThread, std::string& sLine)
+				{
+					static constexpr const char* szLevels[] = { "TRACE", "DEBUG", "INFO ", "WARN ", "ERROR" };
+					static constexpr const char* szCategories[] = { "general", "server", "client", "connection", "transfer" };
+
+					char szPrefix[80];
+					time_t nSeconds = time_t(rec.nTime / 1000000);
+					tm t{};
+					localtime_r(&nSeconds, &t);
+					snprintf(szPrefix, sizeof(szPrefix), "%02d:%02d:%02d.%06u %s %-10s #%u ", t.tm_hour, t.tm_min, t.tm_sec,
+						unsigned(rec.nTime % 1000000), szLevels[size_t(rec.level)], szCategories[size_t(rec.category)], nThread);
+					sLine = szPrefix;
+
+					size_t nArg = 0;
+					for (const char* p = rec.szFormat; *p; p++)
+					{
+						if (p[0] == '{' && p[1] == '}' && nArg < rec.nArgs)
+						{
+							AppendArg(rec, rec.args[nArg++], sLine);
+							p++;
+						}
+						else
+						{
+							sLine += *p;
+						}
+					}
+					sLine += '\n';
+				}
+
+				static void AppendArg(const record& rec, const arg& a, std::string& sLine)
+				{
+					switch (a.type)
+					{
+					case arg::kind::i: sLine += std::to_string(a.i); break;
+					case arg::kind::u: sLine += std::to_string(a.u); break;
+					case arg::kind::d: sLine += std::to_string(a.d); break;
+					case arg::kind::s: sLine.append(rec.szText + a.s.nOffset, a.s.nLength); break;
+					}
+				}
+
+				std::atomic<uint8_t> m_nLevel{ uint8_t(log_level::trace) };
+				std::atomic<uint32_t> m_nCategories{ 0xFFFFFFFF };
+				std::atomic<uint64_t> m_nDropped{ 0 };
+
+				std::mutex m_muxRings;
+				std::vector<std::shared_ptr<ring>> m_vRings;
+				uint32_t m_nNextThread = 0;
+
+				std::mutex m_muxWriter;
+				std::condition_variable m_cvWake;
+				std::condition_variable m_cvSwept;
+				uint64_t m_nSweeps = 0;
+				bool m_bRunning = true;
+				std::ostream* m_pOutput = &std::cout;
+
+				std::thread m_thread;
+		};
+	}
+}
+
+//Statements below TL_NET_LOG_LEVEL are discarded at compile time, so their arguments are never even evaluated.
+#define TL_NET_LOG(LEVEL, CATEGORY, ...) \
+	do \
+	{ \
+		if constexpr (int(tl::net::log_level::LEVEL) >= TL_NET_LOG_LEVEL) \
+		{ \
+			if (tl::net::logger::Enabled(tl::net::log_level::LEVEL, tl::net::log_category::CATEGORY)) \
+				tl::net::logger::Write(tl::net::log_level::LEVEL, tl::net::log_category::CATEGORY, __VA_ARGS__); \
+		} \
+	} while (0)
+
+#define TL_NET_LOG_TRACE(CATEGORY, ...) TL_NET_LOG(trace, CATEGORY, __VA_ARGS__)
+#define TL_NET_LOG_DEBUG(CATEGORY, ...) TL_NET_LOG(debug, CATEGORY, __VA_ARGS__)
+#define TL_NET_LOG_INFO(CATEGORY, ...) TL_NET_LOG(info, CATEGORY, __VA_ARGS__)
+#define TL_NET_LOG_WARN(CATEGORY, ...) TL_NET_LOG(warn, CATEGORY, __VA_ARGS__)
+#define TL_NET_LOG_ERROR(CATEGORY, ...) TL_NET_LOG(error, CATEGORY, __VA_ARGS__)
+
+#endif
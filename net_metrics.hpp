@@ -0,0 +1,287 @@
+#ifndef NET_METRICS_HPP
+#define NET_METRICS_HPP
+/*
+	net_metrics.hpp
+
+	Counters, gauges and latency histograms for a running server, and a tiny endpoint to read them from.
+
+	Instrumentation sits on the same paths as the work it measures, so it has to cost next to nothing:
+
+	- Every counter has exactly one thread that writes to it, e.g. a connection's bytes in are only ever counted by
+	  that connection's io thread. Writing is then a plain load and store on a relaxed atomic, no locked instruction
+	  and no cache line bouncing between threads. Readers add everything up when GetStats() is called.
+	- Gauges (queue depths) aren't stored at all, they are read from the queues when a snapshot is taken.
+	- A histogram is a fixed array of buckets with HDR-style log-linear spacing: below 32 every value has its own
+	  bucket, above that each power of two is split into 16 buckets. Any value up to 2^64 is recorded with a relative
+	  error of at most 1/16, in 8 KiB, with no allocation.
+
+	  value:    0 1 2 ... 31 | 32 34 36 ... 62 | 64 68 72 ... 124 | 128 136 ... | ...
+	  bucket:   0 1 2 ... 31 | 32 33 34 ... 47 | 48 49 50 ...  63 |  64  65 ... | ...
+*/
+
+#include "net_base.h"
+#include "net_bufferPool.hpp"
+#include <functional>
+#include <sstream>
+
+namespace tl
+{
+	namespace net
+	{
+		//A counter written by one thread and read by any
+		class counter
+		{
+			public:
+				void Add(uint64_t n = 1)
+				{
+					m_n.store(m_n.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+				}
+
+				uint64_t Get() const
+				{
+					return m_n.load(std::memory_order_relaxed);
+				}
+
+			protected:
+				std::atomic<uint64_t> m_n{ 0 };
+		};
+
+		//A copy of a histogram's buckets that can be queried and merged with others
+		class histogram_snapshot
+		{
+			public:
+				static constexpr size_t nLinearBuckets = 32;
+				static constexpr size_t nSubBucketBits = 4;
+				static constexpr size_t nSubBuckets = size_t(1) << nSubBucketBits;
+				static constexpr size_t nBuckets = nLinearBuckets + (64 - 5) * nSubBuckets;
+
+				static size_t BucketOf(uint64_t nValue)
+				{
+					if (nValue < nLinearBuckets)
+						return size_t(nValue);
+					size_t nExponent = 63 - size_t(__builtin_clzll(nValue));
+					size_t nSub = size_t(nValue >> (nExponent - nSubBucketBits)) & (nSubBuckets - 1);
+					return nLinearBuckets + (nExponent - 5) * nSubBuckets + nSub;
+				}
+
+				//Smallest value that lands in the bucket
+				static uint64_t LowestOf(size_t nBucket)
+				{
+					if (nBucket < nLinearBuckets)
+						return nBucket;
+					size_t nExponent = (nBucket - nLinearBuckets) / nSubBuckets + 5;
+					size_t nSub = (nBucket - nLinearBuckets) % nSubBuckets;
+					return (uint64_t(nSubBuckets + nSub)) << (nExponent - nSubBucketBits);
+				}
+
+				void Merge(const histogram_snapshot& other)
+				{
+					for (size_t i = 0; i < nBuckets; i++)
+						vCounts[i] += other.vCounts[i];
+					nCount += other.nCount;
+					nSum += other.nSum;
+					nMax = std::max(nMax, other.nMax);
+				}
+
+				//Value at quantile q (0.5 for the median, 0.99 for p99), to within a bucket
+				uint64_t ValueAt(double q) const
+				{
+					if (nCount == 0)
+						return 0;
+					uint64_t nRank = uint64_t(q * double(nCount - 1)) + 1;
+					uint64_t nSeen = 0;
+					for (size_t i = 0; i < nBuckets; i++)
+					{
+						nSeen += vCounts[i];
+						if (nSeen >= nRank)
+							return std::min(LowestOf(i), nMax);
+					}
+					return nMax;
+				}
+
+				double Mean() const
+				{
+					return nCount ? double(nSum) / double(nCount) : 0.0;
+				}
+
+				std::array<uint64_t, nBuckets> vCounts{};
+				uint64_t nCount = 0;
+				uint64_t nSum = 0;
+				uint64_t nMax = 0;
+		};
+
+		//A histogram written by one thread and read by any. Threads that all need to record the same measurement
+		//keep one each and merge the snapshots.
+		class histogram
+		{
+			public:
+				void Record(uint64_t nValue)
+				{
+					Bump(m_vCounts[histogram_snapshot::BucketOf(nValue)], 1);
+					Bump(m_nCount, 1);
+					Bump(m_nSum, nValue);
+					if (nValue > m_nMax.load(std::memory_order_relaxed))
+						m_nMax.store(nValue, std::memory_order_relaxed);
+				}
+
+				histogram_snapshot Snapshot() const
+				{
+					histogram_snapshot s;
+					for (size_t i = 0; i < histogram_snapshot::nBuckets; i++)
+						s.vCounts[i] = m_vCounts[i].load(std::memory_order_relaxed);
+					s.nCount = m_nCount.load(std::memory_order_relaxed);
+					s.nSum = m_nSum.load(std::memory_order_relaxed);
+					s.nMax = m_nMax.load(std::memory_order_relaxed);
+					return s;
+				}
+
+			protected:
+				static void Bump(std::atomic<uint64_t>& n, uint64_t nBy)
+				{
+					n.store(n.load(std::memory_order_relaxed) + nBy, std::memory_order_relaxed);
+				}
+
+				std::array<std::atomic<uint64_t>, histogram_snapshot::nBuckets> m_vCounts{};
+				std::atomic<uint64_t> m_nCount{ 0 };
+				std::atomic<uint64_t> m_nSum{ 0 };
+				std::atomic<uint64_t> m_nMax{ 0 };
+		};
+
+		struct connection_stats
+		{
+			uint32_t nID = 0;
+			uint64_t nBytesIn = 0;
+			uint64_t nBytesOut = 0;
+			uint64_t nInfosIn = 0;
+			uint64_t nInfosOut = 0;
+			//Infos and bytes waiting in the send lanes or being written
+			size_t nQueuedInfos = 0;
+			size_t nQueuedBytes = 0;
+			bool bCongested = false;
+			//Smoothed heartbeat round trip time and its variation
+			uint64_t nRttNanoseconds = 0;
+			uint64_t nRttJitterNanoseconds = 0;
+			//Remote clock minus local clock
+			int64_t nClockOffsetNanoseconds = 0;
+		};
+
+		struct server_stats
+		{
+			std::vector<connection_stats> vConnections;
+			//Infos received but not yet handed to OnInfo
+			size_t nInboundDepth = 0;
+			//Infos handed to the OnInfo workers that they haven't finished with, see SetInfoWorkers
+			size_t nWorkerDepth = 0;
+			//Nanoseconds an info spent in the inbound queue before OnInfo was called
+			histogram_snapshot inboundWait;
+			buffer_pool::stats bufferPool;
+			uint64_t nLogDropped = 0;
+
+			std::string ToText() const
+			{
+				std::ostringstream os;
+				os << "connections " << vConnections.size() << "\n";
+				os << "inbound_depth " << nInboundDepth << "\n";
+				os << "worker_depth " << nWorkerDepth << "\n";
+				os << "inbound_wait_ns count " << inboundWait.nCount << " mean " << uint64_t(inboundWait.Mean())
+					<< " p50 " << inboundWait.ValueAt(0.5) << " p99 " << inboundWait.ValueAt(0.99)
+					<< " p999 " << inboundWait.ValueAt(0.999) << " max " << inboundWait.nMax << "\n";
+				os << "buffer_pool hits " << bufferPool.nHits << " misses " << bufferPool.nMisses
+					<< " oversize " << bufferPool.nOversize << "\n";
+				os << "log_dropped " << nLogDropped << "\n";
+				for (const auto& c : vConnections)
+					os << "[" << c.nID << "] bytes_in " << c.nBytesIn << " bytes_out " << c.nBytesOut
+						<< " infos_in " << c.nInfosIn << " infos_out " << c.nInfosOut
+						<< " queued_infos " << c.nQueuedInfos << " queued_bytes " << c.nQueuedBytes
+						<< " congested " << c.bCongested << " rtt_ns " << c.nRttNanoseconds
+						<< " rtt_jitter_ns " << c.nRttJitterNanoseconds << " clock_offset_ns " << c.nClockOffsetNanoseconds << "\n";
+				return os.str();
+			}
+
+			std::string ToJson() const
+			{
+				std::ostringstream os;
+				os << "{\"inbound_depth\":" << nInboundDepth
+					<< ",\"worker_depth\":" << nWorkerDepth
+					<< ",\"inbound_wait_ns\":{\"count\":" << inboundWait.nCount << ",\"mean\":" << uint64_t(inboundWait.Mean())
+					<< ",\"p50\":" << inboundWait.ValueAt(0.5) << ",\"p99\":" << inboundWait.ValueAt(0.99)
+					<< ",\"p999\":" << inboundWait.ValueAt(0.999) << ",\"max\":" << inboundWait.nMax << "}"
+					<< ",\"buffer_pool\":{\"hits\":" << bufferPool.nHits << ",\"misses\":" << bufferPool.nMisses
+					<< ",\"oversize\":" << bufferPool.nOversize << "}"
+					<< ",\"log_dropped\":" << nLogDropped
+					<< ",\"connections\":[";
+				for (size_t i = 0; i < vConnections.size(); i++)
+				{
+					const auto& c = vConnections[i];
+					os << (i ? "," : "") << "{\"id\":" << c.nID << ",\"bytes_in\":" << c.nBytesIn
+						<< ",\"bytes_out\":" << c.nBytesOut << ",\"infos_in\":" << c.nInfosIn
+						<< ",\"infos_out\":" << c.nInfosOut << ",\"queued_infos\":" << c.nQueuedInfos
+						<< ",\"queued_bytes\":" << c.nQueuedBytes << ",\"congested\":" << (c.bCongested ? "true" : "false")
+						<< ",\"rtt_ns\":" << c.nRttNanoseconds << ",\"rtt_jitter_ns\":" << c.nRttJitterNanoseconds
+							<< ",\"clock_offset_ns\":" << c.nClockOffsetNanoseconds << "}";
+				}
+				os << "]}";
+				return os.str();
+			}
+		};
+
+		//Answers every HTTP request on a local port with the output of fnReport. A request for a path containing
+		//"json" gets JSON, anything else gets plain text, so both curl and a browser work.
+		class stats_endpoint
+		{
+			public:
+				stats_endpoint(asio::io_context& context, uint16_t port, std::function<std::string(bool bJson)> fnReport)
+					: m_acceptor(context, asio::ip::tcp::endpoint(asio::ip::address_v4::loopback(), port)),
+					  m_fnReport(std::move(fnReport))
+				{
+					Accept();
+				}
+
+			protected:
+				struct session
+				{
+					asio::ip::tcp::socket socket;
+					std::array<char, 1024> request{};
+					std::string sResponse;
+				};
+
+				void Accept()
+				{
+					m_acceptor.async_accept([this](std::error_code ec, asio::ip::tcp::socket socket)
+						{
+							if (ec)
+								return;
+
+							auto pSession = std::make_shared<session>(session{ std::move(socket) });
+							pSession->socket.async_read_some(asio::buffer(pSession->request),
+								[this, pSession](std::error_code ec, std::size_t length)
+								{
+									if (ec)
+										return;
+
+									std::string_view sRequest(pSession->request.data(), length);
+									bool bJson = sRequest.substr(0, sRequest.find('\n')).find("json") != std::string_view::npos;
+									std::string sBody = m_fnReport(bJson);
+
+									pSession->sResponse = std::string("HTTP/1.0 200 OK\r\nContent-Type: ") +
+										(bJson ? "application/json" : "text/plain") +
+										"\r\nContent-Length: " + std::to_string(sBody.size()) + "\r\n\r\n" + sBody;
+
+									asio::async_write(pSession->socket, asio::buffer(pSession->sResponse),
+										[pSession](std::error_code, std::size_t)
+										{
+											pSession->socket.close();
+										});
+								});
+
+							Accept();
+						});
+				}
+
+				asio::ip::tcp::acceptor m_acceptor;
+				std::function<std::string(bool)> m_fnReport;
+		};
+	}
+}
+
+#endif
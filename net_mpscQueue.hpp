@@ -0,0 +1,276 @@
+#ifndef NET_MPSCQUEUE_HPP
+#define NET_MPSCQUEUE_HPP
+/*
+	net_mpscQueue.hpp
+
+	On the receive path every Connection owned by the server pushes into the one shared m_qInfosIn, while only the
+	thread calling server_interface::Update() ever pops from it. That is a Multiple Producer / Single Consumer (MPSC)
+	situation, and with hundreds of Connections all fighting over threadsafeQueue's muxQueue that mutex becomes the
+	slowest part of the whole server.
+
+	mpscQueue replaces the mutex with a bounded ring buffer of slots. Each slot carries a sequence number which tells
+	producers and the consumer whose turn it is to touch that slot:
+
+	 enqueue position (producers, shared)               dequeue position (consumer only)
+	              |                                                  |
+	              v                                                  v
+	 |--------|--------|--------|--------|--------|--------|--------|--------|
+	 | seq=8  | seq=9  | seq=2  | seq=3  | seq=4  | seq=5  | seq=6  | seq=7  |
+	 | empty  | empty  |  full  |  full  |  full  |  full  |  full  |  full  |
+	 |--------|--------|--------|--------|--------|--------|--------|--------|
+
+	- A producer claims a slot with a single compare-and-swap on the enqueue position. The slot is free for it when
+	  seq == position.
+	- After writing the item the producer publishes it by setting seq = position + 1.
+	- The consumer reads the slot when seq == position + 1, and hands it back to the producers by setting
+	  seq = position + capacity.
+
+	Nobody ever takes a lock. The only time a thread goes to the kernel is when the consumer has nothing to do and
+	goes to sleep in wait(). That sleep is a futex on m_nSignal (std::atomic::wait is implemented with futex on Linux),
+	and since the consumer re-checks the queue after it has read m_nSignal, a push can't slip in between the check and
+	the sleep the way it could with threadsafeQueue::wait().
+*/
+
+#include "net_base.h"
+#include "net_readiness.hpp"
+
+namespace tl
+{
+	namespace net
+	{
+		template<typename T>
+		class mpscQueue
+		{
+			public:
+				//The capacity is always rounded up to a power of two so that a position can be turned into a slot
+				//index with a mask rather than a division.
+				explicit mpscQueue(size_t nCapacity = 8192)
+				{
+					size_t n = 2;
+					while (n < nCapacity) n <<= 1;
+
+					m_nMask = n - 1;
+					m_pSlots = std::make_unique<slot[]>(n);
+
+					for (size_t i = 0; i < n; i++)
+						m_pSlots[i].seq.store(i, std::memory_order_relaxed);
+				}
+
+				//As with threadsafeQueue, the queue can't be copied.
+				mpscQueue(const mpscQueue<T>&) = delete;
+
+				virtual ~mpscQueue()
+				{
+					clear();
+				}
+
+				size_t capacity() const
+				{
+					return m_nMask + 1;
+				}
+
+				//Adds an item to back of queue. Returns false instead of waiting when the queue is full.
+				//Safe to call from any number of threads at once.
+				bool try_push_back(T&& item)
+				{
+					size_t pos = m_nEnqueuePos.load(std::memory_order_relaxed);
+					slot* s = nullptr;
+
+					for (;;)
+					{
+						s = &m_pSlots[pos & m_nMask];
+						size_t seq = s->seq.load(std::memory_order_acquire);
+						intptr_t diff = intptr_t(seq) - intptr_t(pos);
+
+						if (diff == 0)
+						{
+							//The slot is free, try to claim it. If another producer beat us to it, pos is reloaded
+							//by compare_exchange_weak and we go around again.
+							if (m_nEnqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+								break;
+						}
+						else if (diff < 0)
+						{
+							//The consumer hasn't released this slot yet, the ring is full.
+							return false;
+						}
+						else
+						{
+							pos = m_nEnqueuePos.load(std::memory_order_relaxed);
+						}
+					}
+
+					new (s->storage) T(std::move(item));
+					s->seq.store(pos + 1, std::memory_order_release);
+
+					notify();
+					return true;
+				}
+
+				bool try_push_back(const T& item)
+				{
+					T copy(item);
+					return try_push_back(std::move(copy));
+				}
+
+				//Adds an item to back of queue. If the queue is full the producer yields until the consumer has made
+				//room, which pushes back on the network threads rather than growing memory without bound.
+				void push_back(T&& item)
+				{
+					while (!try_push_back(std::move(item)))
+						std::this_thread::yield();
+				}
+
+				void push_back(const T& item)
+				{
+					T copy(item);
+					push_back(std::move(copy));
+				}
+
+				//Returns if Queue has no items. Only meaningful on the consumer thread, from anywhere else it is a hint.
+				bool empty() const
+				{
+					size_t pos = m_nDequeuePos.load(std::memory_order_relaxed);
+					return m_pSlots[pos & m_nMask].seq.load(std::memory_order_acquire) != pos + 1;
+				}
+
+				//Returns number of items in Queue. Items that have been claimed by a producer but not yet published are
+				//counted, so treat this as approximate while producers are running.
+				size_t size() const
+				{
+					size_t nBack = m_nEnqueuePos.load(std::memory_order_relaxed);
+					size_t nFront = m_nDequeuePos.load(std::memory_order_relaxed);
+					return nBack > nFront ? nBack - nFront : 0;
+				}
+
+				//Returns and maintains item at front of Queue. Consumer only, and the queue must not be empty.
+				T& front()
+				{
+					size_t pos = m_nDequeuePos.load(std::memory_order_relaxed);
+					return *reinterpret_cast<T*>(m_pSlots[pos & m_nMask].storage);
+				}
+
+				//Removes and returns item from front of Queue. Consumer only.
+				std::optional<T> try_pop_front()
+				{
+					size_t pos = m_nDequeuePos.load(std::memory_order_relaxed);
+					slot& s = m_pSlots[pos & m_nMask];
+
+					if (s.seq.load(std::memory_order_acquire) != pos + 1)
+						return std::nullopt;
+
+					std::optional<T> t = Take(s, pos);
+					m_nDequeuePos.store(pos + 1, std::memory_order_relaxed);
+					return t;
+				}
+
+				//Removes and returns item from front of Queue. Consumer only, and the queue must not be empty.
+				T pop_front()
+				{
+					return std::move(*try_pop_front());
+				}
+
+				//Removes up to nMax items from the front of the Queue and writes them to out. Returns how many items
+				//were removed. The dequeue position is only published once for the whole batch, and each item is
+				//moved straight from its slot to out rather than through an optional as try_pop_front() does.
+				template<typename OutputIt>
+				size_t try_pop_n(OutputIt out, size_t nMax)
+				{
+					size_t pos = m_nDequeuePos.load(std::memory_order_relaxed);
+					size_t nCount = 0;
+
+					while (nCount < nMax)
+					{
+						slot& s = m_pSlots[(pos + nCount) & m_nMask];
+						if (s.seq.load(std::memory_order_acquire) != pos + nCount + 1)
+							break;
+
+						T* p = reinterpret_cast<T*>(s.storage);
+						*out++ = std::move(*p);
+						p->~T();
+						s.seq.store(pos + nCount + m_nMask + 1, std::memory_order_release);
+						nCount++;
+					}
+
+					m_nDequeuePos.store(pos + nCount, std::memory_order_relaxed);
+					return nCount;
+				}
+
+				// Clears Queue. Consumer only.
+				void clear()
+				{
+					while (try_pop_front())
+					{
+					}
+				}
+
+				//Pokes pEvent as well as waking wait() whenever an item is pushed, so the queue can be watched from a
+				//poll loop. Set it before any producer starts.
+				void set_notify(readiness_event* pEvent)
+				{
+					m_pNotify = pEvent;
+				}
+
+				//Wakes the consumer without adding anything, e.g. to let it see a connection close
+				void notify()
+				{
+					m_nSignal.fetch_add(1, std::memory_order_seq_cst);
+
+					//Only pay for the futex wake system call when the consumer is actually asleep.
+					if (m_bWaiting.load(std::memory_order_seq_cst))
+						m_nSignal.notify_one();
+
+					if (m_pNotify)
+						m_pNotify->Notify();
+				}
+
+				//Sends the consumer to sleep until there is something in the queue.
+				void wait()
+				{
+					while (empty())
+					{
+						//Read the signal before checking the queue again. If a producer pushes after this load, it
+						//also changes m_nSignal and the futex wait below returns straight away.
+						uint32_t nSignal = m_nSignal.load(std::memory_order_acquire);
+
+						m_bWaiting.store(true, std::memory_order_seq_cst);
+						if (empty())
+							m_nSignal.wait(nSignal, std::memory_order_acquire);
+						m_bWaiting.store(false, std::memory_order_relaxed);
+					}
+				}
+
+			protected:
+				struct slot
+				{
+					std::atomic<size_t> seq{ 0 };
+					alignas(T) unsigned char storage[sizeof(T)];
+				};
+
+				std::optional<T> Take(slot& s, size_t pos)
+				{
+					T* p = reinterpret_cast<T*>(s.storage);
+					std::optional<T> t(std::move(*p));
+					p->~T();
+
+					//Hand the slot back to producers for their next lap around the ring.
+					s.seq.store(pos + m_nMask + 1, std::memory_order_release);
+					return t;
+				}
+
+				std::unique_ptr<slot[]> m_pSlots;
+				size_t m_nMask = 0;
+
+				//Producers and the consumer each get their own cache line, otherwise every push would invalidate
+				//the consumer's copy of the dequeue position and the other way round.
+				alignas(64) std::atomic<size_t> m_nEnqueuePos{ 0 };
+				alignas(64) std::atomic<size_t> m_nDequeuePos{ 0 };
+
+				alignas(64) std::atomic<uint32_t> m_nSignal{ 0 };
+				std::atomic<bool> m_bWaiting{ false };
+				readiness_event* m_pNotify = nullptr;
+		};
+	}
+}
+
+#endif
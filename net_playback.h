@@ -0,0 +1,159 @@
+#ifndef NET_PLAYBACK_H
+#define NET_PLAYBACK_H
+/*
+	net_playback.h
+
+	When one stream is cast to many screens, each receiver starting playback as soon as the play info reaches it
+	leaves them out of step by however much the network delay to each one differs. Instead, a play, pause or seek is
+	scheduled for an instant on the server's clock a little in the future, and every receiver acts at that instant:
+
+	   Controller              Server                              Receivers
+	     |--- request ------------>|                                   |
+	     |  { play }               |--- command --------------------->|  each waits until the server's clock
+	     |                         |  { play, position, at server T }  |  says T, then starts at position
+	     |                         |--- command --------------------->|
+
+	Every client knows the server's clock from the heartbeats (see Connection::GetClockOffset), so waiting for server
+	time T is client_interface::RunAtServerTime. T is put far enough ahead that the command reaches the slowest
+	receiver first, and the server keeps the one true timeline so that every receiver pauses at the same position.
+
+	The info types used for the request and command are chosen by the application through playback_ids, since T is
+	the application's own enum.
+*/
+
+#include "net_base.h"
+#include "net_info.h"
+
+namespace tl
+{
+	namespace net
+	{
+		template<typename T>
+		struct playback_ids
+		{
+			T request{};
+			T command{};
+		};
+
+		enum class playback_action : uint32_t
+		{
+			play,
+			pause,
+			seek
+		};
+
+		//Sent by a controller to ask for an action, and by the server to say when it happens. In a request
+		//nServerTime is ignored and nPosition is only used by seek.
+		struct playback_command
+		{
+			playback_action action = playback_action::play;
+			uint32_t nReserved = 0;
+			//When to act, on the server's steady_clock in nanoseconds
+			uint64_t nServerTime = 0;
+			//Media position to be at from nServerTime on, in nanoseconds
+			int64_t nPosition = 0;
+		};
+
+		//Takes the playback_command out of a request or command. Returns false, leaving command alone, if the body
+		//isn't exactly one command with a known action, since the info comes from the other side of the network.
+		template<typename T>
+		bool ReadPlaybackCommand(info<T>& info, playback_command& command)
+		{
+			if (info.body.size() != sizeof(playback_command))
+				return false;
+
+			playback_command read;
+			info >> read;
+			if (read.action != playback_action::play && read.action != playback_action::pause && read.action != playback_action::seek)
+				return false;
+
+			command = read;
+			return true;
+		}
+
+		//Builds the info a controller sends to ask for an action
+		template<typename T>
+		info<T> MakePlaybackRequest(const playback_ids<T>& ids, playback_action action, int64_t nPosition = 0)
+		{
+			info<T> request;
+			request.header.id = ids.request;
+			playback_command command;
+			command.action = action;
+			command.nPosition = nPosition;
+			request << command;
+			return request;
+		}
+
+		//Lives on the server and turns requests into commands. It keeps the shared timeline: whether playback is
+		//running, and which media position it was at at which server time.
+		template<typename T>
+		class playback_scheduler
+		{
+			public:
+				playback_scheduler(playback_ids<T> ids, std::chrono::milliseconds minLead = std::chrono::milliseconds(100))
+					: m_ids(ids), m_minLead(minLead)
+				{
+				}
+
+				//Schedules the action asked for in request and returns the command to send to every receiver. maxRtt
+				//is the longest round trip to any receiver (server_interface::GetMaxRtt); the command is timed to
+				//take effect two of those after now, and never sooner than the minimum lead. Returns nothing, and
+				//leaves the timeline as it was, if the request isn't a valid playback_command.
+				std::optional<info<T>> Schedule(info<T> request, std::chrono::nanoseconds maxRtt)
+				{
+					playback_command command;
+					if (!ReadPlaybackCommand(request, command))
+						return std::nullopt;
+
+					uint64_t nLead = uint64_t(std::max<int64_t>(
+						std::chrono::duration_cast<std::chrono::nanoseconds>(m_minLead).count(), 2 * maxRtt.count()));
+					command.nServerTime = std::max(SteadyNanoseconds() + nLead, m_nAnchorTime);
+
+					switch (command.action)
+					{
+						case playback_action::play:
+							command.nPosition = PositionAt(command.nServerTime);
+							m_bPlaying = true;
+							break;
+						case playback_action::pause:
+							command.nPosition = PositionAt(command.nServerTime);
+							m_bPlaying = false;
+							break;
+						case playback_action::seek:
+							command.nPosition = std::max<int64_t>(command.nPosition, 0);
+							break;
+					}
+					m_nAnchorTime = command.nServerTime;
+					m_nAnchorPosition = command.nPosition;
+
+					info<T> out;
+					out.header.id = m_ids.command;
+					out << command;
+					return out;
+				}
+
+				//Media position at a server time, following the timeline scheduled so far
+				int64_t PositionAt(uint64_t nServerTime) const
+				{
+					if (!m_bPlaying || nServerTime <= m_nAnchorTime)
+						return m_nAnchorPosition;
+					return m_nAnchorPosition + int64_t(nServerTime - m_nAnchorTime);
+				}
+
+				bool IsPlaying() const
+				{
+					return m_bPlaying;
+				}
+
+			protected:
+				playback_ids<T> m_ids;
+				std::chrono::milliseconds m_minLead;
+				bool m_bPlaying = false;
+				//The last scheduled command: from m_nAnchorTime on, the media is at m_nAnchorPosition
+				uint64_t m_nAnchorTime = 0;
+				int64_t m_nAnchorPosition = 0;
+		};
+	}
+}
+
+#endif
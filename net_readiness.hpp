@@ -0,0 +1,80 @@
+#ifndef NET_READINESS_HPP
+#define NET_READINESS_HPP
+/*
+	net_readiness.hpp
+
+	A client application has to notice two things: an info has come in from the server, or the user has asked for
+	something through the window. Polling Incoming().empty() and UserCommands().empty() in a loop notices both
+	quickly, but keeps a core busy even when nothing is happening. Blocking in wait() on one queue misses the other.
+
+	readiness_event is a Linux eventfd that the queues poke whenever they are pushed to. Its file descriptor can be
+	handed to anything that polls file descriptors, such as the GLib main loop (see net_glib.h), epoll or poll(), so
+	one thread can sleep until either queue has something in it, using no CPU meanwhile:
+
+	   io thread / GTK callbacks                         main loop
+	     push to a queue                                   |
+	     Notify() --- write to the eventfd, only if ---->  poll() returns
+	                  it isn't already pending             Clear()
+	                                                       drain every queue until empty
+
+	Only the first Notify() after a Clear() pays for the write system call, so a burst of infos costs one wake up.
+	The consumer must Clear() before draining, not after: an item pushed while it drains then either shows up in the
+	drain or writes to the eventfd again.
+*/
+
+#include "net_base.h"
+#include <sys/eventfd.h>
+
+namespace tl
+{
+	namespace net
+	{
+		class readiness_event
+		{
+			public:
+				readiness_event()
+				{
+					m_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+				}
+
+				readiness_event(const readiness_event&) = delete;
+				readiness_event& operator=(const readiness_event&) = delete;
+
+				~readiness_event()
+				{
+					if (m_fd >= 0)
+						close(m_fd);
+				}
+
+				//Readable (POLLIN) from the first Notify() until the next Clear(). -1 if no eventfd could be made.
+				int GetFd() const
+				{
+					return m_fd;
+				}
+
+				//Makes the descriptor readable. Safe to call from any thread.
+				void Notify()
+				{
+					if (m_bPending.exchange(true, std::memory_order_seq_cst))
+						return;
+
+					uint64_t nOne = 1;
+					[[maybe_unused]] ssize_t n = write(m_fd, &nOne, sizeof(nOne));
+				}
+
+				//Makes the descriptor unreadable again. Only called by the consumer, before it drains the queues.
+				void Clear()
+				{
+					uint64_t nCount;
+					[[maybe_unused]] ssize_t n = read(m_fd, &nCount, sizeof(nCount));
+					m_bPending.store(false, std::memory_order_seq_cst);
+				}
+
+			protected:
+				int m_fd = -1;
+				std::atomic<bool> m_bPending{ false };
+		};
+	}
+}
+
+#endif
@@ -5,7 +5,14 @@
 #include "net_threadsafeQueue.hpp"
 #include "net_info.h"
 #include "net_connection.h"
+#include "net_slotMap.hpp"
+#include "net_log.hpp"
+#include "net_metrics.hpp"
 #include<iostream>
+#include<random>
+#include <sys/random.h>
+#include<span>
+#include<unordered_map>
 namespace tl
 {
 	namespace net
@@ -13,17 +20,63 @@ namespace tl
 		template<typename T>
 		class server_interface
 		{
-		public:
+		protected:
+			//Each worker is an ASIO context with the thread that runs it. Connected clients
+			//are spread across the workers.
+			struct io_worker
+			{
+				asio::io_context context;
+				//ASIO Contexts need a thread
+				std::thread thread;
+				//Here we get the sockets of the connected clients which needs an ASIO
+				//context. Null for workers that don't accept connections themselves.
+				std::unique_ptr<asio::ip::tcp::acceptor> acceptor;
+			};
 
-			server_interface(uint16_t port)
-				: m_asioAcceptor(m_asioContext, asio::ip::tcp::endpoint(asio::ip::address_v4::any(), port))
+		public:
 
+			//nThreads is how many io_contexts the server runs, each on its own thread. Every connection lives on
+			//exactly one of them for its whole life, so a connection's handlers never run on two threads at once
+			//and need no locking of their own.
+			server_interface(uint16_t port, size_t nThreads = 1)
 			{
+				nThreads = std::max<size_t>(nThreads, 1);
+				for (size_t i = 0; i < nThreads; i++)
+					m_vWorkers.push_back(std::make_unique<io_worker>());
+
+				asio::ip::tcp::endpoint endpoint(asio::ip::address_v4::any(), port);
+
+#if defined(SO_REUSEPORT)
+				//With SO_REUSEPORT every worker gets its own listening socket on the same port and the kernel
+				//spreads incoming connections across them, so accepting is sharded as well.
+				for (auto& worker : m_vWorkers)
+				{
+					worker->acceptor = std::make_unique<asio::ip::tcp::acceptor>(worker->context);
+					worker->acceptor->open(endpoint.protocol());
+					worker->acceptor->set_option(asio::ip::tcp::acceptor::reuse_address(true));
+					worker->acceptor->set_option(reuse_port(true));
+					worker->acceptor->bind(endpoint);
+					worker->acceptor->listen();
+				}
+#else
+				//Without SO_REUSEPORT the first worker accepts for everyone and hands each new socket to the
+				//workers in turn.
+				m_vWorkers.front()->acceptor = std::make_unique<asio::ip::tcp::acceptor>(m_vWorkers.front()->context, endpoint);
+#endif
 			}
 
 			virtual ~server_interface()
 			{
 				Stop();
+
+				//Connections own sockets that belong to the workers' contexts, so they have to go before the
+				//workers do. The inbound queue holds references to them too.
+				m_qInfosIn.clear();
+				std::scoped_lock lock(m_muxConnections);
+				m_connections.clear();
+
+				if (!m_sLocalPath.empty())
+					::unlink(m_sLocalPath.c_str());
 			}
 
 			bool Start()
@@ -33,99 +86,201 @@ namespace tl
 					//Notice the ordering of events, that's important
 					//Because at first we issue some tasks for the ASIO context
 					//in order to keep it alive.
-					WaitForClientConnection();
-					m_threadContext = std::thread([this]() {m_asioContext.run(); });
+					for (auto& worker : m_vWorkers)
+						if (worker->acceptor)
+							asio::co_spawn(worker->context, WaitForClientConnection(*worker), asio::detached);
+
+					for (auto& worker : m_vWorkers)
+						worker->thread = std::thread([&context = worker->context]() {context.run(); });
 				}
 				catch (std::exception& e)
 				{
 					// Something prohibited the server from listening
-					std::cerr << "[SERVER] Exception: " << e.what() << std::endl;
+					TL_NET_LOG_ERROR(server, "[SERVER] Exception: {}", e.what());
 					return false;
 				}
 
-				std::cout << "[SERVER] Started\n";
+				TL_NET_LOG_INFO(server, "[SERVER] Started");
 				return true;
 
 			}
 
 			void Stop()
 			{
-				//Request context to close. This can take some time.
-				m_asioContext.stop();
+				//Request every context to close. This can take some time.
+				for (auto& worker : m_vWorkers)
+					worker->context.stop();
 
-				//Since it will take some time, we can wait for ASIO and the thread to stop
+				//Since it will take some time, we can wait for ASIO and the threads to stop
 				//by calling the join()
-				if (m_threadContext.joinable()) m_threadContext.join();
+				for (auto& worker : m_vWorkers)
+					if (worker->thread.joinable()) worker->thread.join();
+
+				//Handlers still queued for the OnInfo workers are dropped, one that is running is finished
+				if (m_pInfoWorkers)
+				{
+					m_pInfoWorkers->stop();
+					m_pInfoWorkers->join();
+				}
 
-				std::cout << "[SERVER] Stopped" << std::endl;
+				TL_NET_LOG_INFO(server, "[SERVER] Stopped");
 
 
 			}
 
 			//This task is for the ASIO context. Asynchronous - Instruct
-			//ASIO to wait for connection
-			void WaitForClientConnection()
-			{
-				//Recall: the ASIO context has been associated with the acceptor object
-				//With these functions we pass a lambda function which does the work
-				//when whatever causes the async_accept() to fire
-				m_asioAcceptor.async_accept(
-					[this](std::error_code ec, asio::ip::tcp::socket socket)
+			//ASIO to wait for connections on the acceptor of the given worker, one after another,
+			//for as long as the acceptor is open
+			asio::awaitable<void> WaitForClientConnection(io_worker& worker)
+			{
+				while (worker.acceptor->is_open())
+				{
+					//A sharded acceptor keeps its connections on its own worker. A shared one picks the next worker
+					//round-robin, and asio creates the socket directly on that worker's context.
+					io_worker& target = bShardedAccept ? worker : *m_vWorkers[m_nNextWorker++ % m_vWorkers.size()];
+
+					asio::error_code ec;
+					asio::ip::tcp::socket socket = co_await worker.acceptor->async_accept(target.context,
+						asio::redirect_error(asio::use_awaitable, ec));
+
+					if (!ec)
 					{
-						if (!ec)
-						{
-							//socket.remote_endpoint() returns the ip address of the newly connected
-							//client
-							std::cout << "[SERVER] New Connection: " << socket.remote_endpoint() << std::endl;
-
-							//Tell the connection that it is owned by a server
-							//and this is simply because we want to tailor how the 
-							//connection behaves depending on if it is primarily owned
-							//by a server or a client. Both the server and the client
-							//will use the same connection object, but there is a slight
-							//difference around the edges
-							//m_asioContext is the current ASIO Context
-							//socket is the socket provided by the async accept function
-							//since m_qInfosIn is passed by reference, it becomes shared
-							//accross all of the connections.
-							//But m_qInfosIn is threadsafe when ading messages to it.
-							std::shared_ptr<Connection<T>> newConnection =
-								std::make_shared<Connection<T>>(Connection<T>::owner::server,
-									m_asioContext, std::move(socket), m_qInfosIn);
-
-							// Give the user server a chance to deny connection
-							// By default OnClientConnect() returns false.
-							// So the user must provide some sort of override
-							// to return true.
-							if (OnClientConnect(newConnection))
-							{
-								//Connection allowed, so add to container of new connections
-								m_deqConnections.push_back(std::move(newConnection));
+						//socket.remote_endpoint() returns the ip address of the newly connected
+						//client. The client may already be gone, and the overload that throws would end the loop.
+						asio::error_code ecEndpoint;
+						asio::ip::tcp::endpoint remote = socket.remote_endpoint(ecEndpoint);
+						TL_NET_LOG_INFO(server, "[SERVER] New Connection: {}:{}",
+							remote.address().to_string(), remote.port());
+
+						AdmitConnection(std::move(socket), target);
+					}
+					else
+					{
+						//Error has occured during acceptance
+						TL_NET_LOG_WARN(server, "[SERVER] New Connection Error: {}", ec.message());
+					}
 
-								//Valid connection is assigned their identifier
-								m_deqConnections.back()->ConnectToClient(this, nIDCounter++);
+					//Looping round primes ASIO with more work - again simply wait
+					//for another connection
+				}
+			}
 
-								std::cout << "[" << m_deqConnections.back()->GetID() << "] Connection Approved\n";
-							}
-							//Here the connection is denied. Also, newConnection is shared_ptr object
-							//which when it goes out of scope of this function, will be deleted.
-							else
+			//Accepts on the server's AF_UNIX socket, see ListenLocal and ListenSharedMemory
+			asio::awaitable<void> WaitForLocalConnection()
+			{
+				while (m_pLocalAcceptor->is_open())
+				{
+					//There is only one local acceptor, so it always hands its connections to the workers in turn
+					io_worker& target = *m_vWorkers[m_nNextWorker++ % m_vWorkers.size()];
+
+					asio::error_code ec;
+					asio::local::stream_protocol::socket socket = co_await m_pLocalAcceptor->async_accept(target.context,
+						asio::redirect_error(asio::use_awaitable, ec));
+
+					if (ec)
+					{
+						if (ec != asio::error::operation_aborted)
+							TL_NET_LOG_WARN(server, "[SERVER] New Local Connection Error: {}", ec.message());
+						continue;
+					}
+
+					TL_NET_LOG_INFO(server, "[SERVER] New {} Connection: {}", m_bLocalShm ? "Shared Memory" : "Local", m_sLocalPath);
+					if (m_bLocalShm)
+						//The client's offer of shared memory is waited for on the connection's own worker, so a slow
+						//client doesn't hold up the next one
+						asio::co_spawn(target.context, AcceptSharedMemory(stream_socket(std::move(socket)), target), asio::detached);
+					else
+						AdmitConnection(std::move(socket), target);
+				}
+			}
+
+			//Waits for a client connected to the shared memory socket to hand over its rings, then admits it
+			asio::awaitable<void> AcceptSharedMemory(stream_socket socket, io_worker& target)
+			{
+				//A client that connects and never makes its offer is given up on after the handshake timeout, like
+				//one that never answers the challenge. The timer only holds a weak reference, so it may fire after
+				//the offer has come without touching a socket that has moved on.
+				auto pSocket = std::make_shared<stream_socket>(std::move(socket));
+				asio::steady_timer timer(target.context);
+				if (m_timeouts.handshake.count() > 0)
+				{
+					timer.expires_after(m_timeouts.handshake);
+					timer.async_wait([pWeak = std::weak_ptr<stream_socket>(pSocket)](asio::error_code ec)
+						{
+							auto pSocket = pWeak.lock();
+							if (!ec && pSocket)
 							{
-								std::cout << "[-----] Connection Denied\n";
+								TL_NET_LOG_WARN(server, "[-----] No shared memory offer in time, closing");
+								pSocket->close(ec);
 							}
-						}
-						else
-						{
-							//Error has occured during acceptance
-							std::cout << "[SERVER] New Connection Error: " << ec.message() << std::endl;
-						}
+						});
+				}
 
-						//Calling this function again since we don't want the ASIO
-						//context to have nothing to do.
-						//It primes ASIO with more work - again simply wait for another
-						//connection
-						WaitForClientConnection();
-					});
+				asio::error_code ec;
+				co_await pSocket->async_wait(stream_socket::wait_read, asio::redirect_error(asio::use_awaitable, ec));
+				timer.cancel();
+				if (ec)
+					co_return;
+
+				std::unique_ptr<shm_channel> pShm = shm_channel::Accept(std::move(*pSocket));
+				if (!pShm)
+				{
+					TL_NET_LOG_WARN(server, "[-----] Connection Denied, no valid shared memory offer");
+					co_return;
+				}
+				AdmitConnection(transport_stream(std::move(pShm)), target);
+			}
+
+			//Makes a connection from a newly accepted transport and, if OnClientConnect agrees, registers it and
+			//starts the handshake. Called on the thread of the worker that accepted.
+			void AdmitConnection(transport_stream socket, io_worker& target)
+			{
+				//Tell the connection that it is owned by a server
+				//and this is simply because we want to tailor how the 
+				//connection behaves depending on if it is primarily owned
+				//by a server or a client. Both the server and the client
+				//will use the same connection object, but there is a slight
+				//difference around the edges
+				//m_asioContext is the current ASIO Context
+				//socket is the socket provided by the async accept function
+				//since m_qInfosIn is passed by reference, it becomes shared
+				//accross all of the connections.
+				//But m_qInfosIn is threadsafe when ading messages to it.
+				//The connection is pinned to the context its socket was created on.
+				std::shared_ptr<Connection<T>> newConnection =
+					std::make_shared<Connection<T>>(Connection<T>::owner::server,
+						target.context, std::move(socket), m_qInfosIn);
+				newConnection->SetBackpressure(m_watermarks, m_nBackpressurePolicy);
+				newConnection->SetHeartbeat(m_heartbeat);
+				newConnection->SetTimeouts(m_timeouts);
+
+				// Give the user server a chance to deny connection
+				// By default OnClientConnect() returns false.
+				// So the user must provide some sort of override
+				// to return true.
+				if (OnClientConnect(newConnection))
+				{
+					//Connection allowed, so add to the registry of connections. The slot it lands in
+					//becomes its identifier. Other workers may be accepting at the same moment, so the
+					//registry is guarded.
+					std::scoped_lock lock(m_muxConnections);
+					uint32_t nID = m_connections.insert(newConnection);
+					if (nID != 0)
+					{
+						newConnection->ConnectToClient(this, nID);
+						TL_NET_LOG_INFO(server, "[{}] Connection Approved", nID);
+					}
+					else
+					{
+						TL_NET_LOG_WARN(server, "[-----] Connection Denied, no free slots");
+					}
+				}
+				//Here the connection is denied. Also, newConnection is shared_ptr object
+				//which when it goes out of scope of this function, will be deleted.
+				else
+				{
+					TL_NET_LOG_INFO(server, "[-----] Connection Denied");
+				}
 			}
 
 			//Send a message to a specific client
@@ -150,55 +305,188 @@ namespace tl
 					//can or can't communicate with the client.
 					//In the event that we can't communicate with the client, we know that 
 					//the client has been disconnected.
-					OnClientDisconnect(client);
-					//The client is no longer valid so we delete it
-					client.reset();
-					//Since we can identify deleted clients, we use the std::remove()
-					//to entirely remove the client from the deque of connections.
-					//If we had many different clients, this erasure could become a very
-					//expensive operation. Therefore, we want to take that into account
-					//when inofing all connections.
-					m_deqConnections.erase(
-						std::remove(m_deqConnections.begin(), m_deqConnections.end(), client), m_deqConnections.end()
-					);
+					//The client is no longer valid so we remove it from the registry by its ID, which costs
+					//the same however many clients there are. Whoever removes it first reports it, so
+					//OnClientDisconnect is called once per client however it was found out.
+					//A client whose session can still be resumed is kept, and the info is dropped.
+					if (DropClient(client))
+						ReportDisconnect(client);
 				}
 			}
 
+			//Send a message to a specific client, moving its body along instead of copying it. A client found to
+			//be disconnected is dealt with as above.
+			void SendInfoToClient(std::shared_ptr<Connection<T>> client, info<T>&& info)
+			{
+				if (client && client->IsConnected())
+					client->Send(std::move(info));
+				else if (DropClient(client))
+					ReportDisconnect(client);
+			}
+
+			//Send a message to the client with the given ID. Returns false if there is no such client any more.
+			bool SendInfoToClient(uint32_t nID, const info<T>& info)
+			{
+				std::shared_ptr<Connection<T>> client = GetClient(nID);
+				if (!client)
+					return false;
+				SendInfoToClient(client, info);
+				return true;
+			}
+
+			bool SendInfoToClient(uint32_t nID, info<T>&& info)
+			{
+				std::shared_ptr<Connection<T>> client = GetClient(nID);
+				if (!client)
+					return false;
+				SendInfoToClient(client, std::move(info));
+				return true;
+			}
+
+			//Looks up a client by its ID. Returns nullptr if the client has gone, even if its ID has since been
+			//handed to a newer client in the same slot.
+			std::shared_ptr<Connection<T>> GetClient(uint32_t nID)
+			{
+				std::scoped_lock lock(m_muxConnections);
+				std::shared_ptr<Connection<T>>* pClient = m_connections.find(nID);
+				return pClient ? *pClient : nullptr;
+			}
+
+			size_t GetClientCount()
+			{
+				std::scoped_lock lock(m_muxConnections);
+				return m_connections.size();
+			}
+
+			//The longest smoothed round trip time of any client, e.g. to schedule something far enough ahead that
+			//every client has heard about it in time
+			std::chrono::nanoseconds GetMaxRtt()
+			{
+				std::scoped_lock lock(m_muxConnections);
+				std::chrono::nanoseconds maxRtt(0);
+				for (auto& client : m_connections)
+					maxRtt = std::max(maxRtt, client->GetRtt());
+				return maxRtt;
+			}
+
+			//Send part of a file to a specific client, straight from the page cache. See Connection::SendFile, whose
+			//result is returned; false as well if the client has gone.
+			bool SendFileToClient(std::shared_ptr<Connection<T>> client, std::shared_ptr<file_source> pFile,
+				uint64_t nOffset, uint32_t nLength, info<T> info = {})
+			{
+				if (client && client->IsConnected())
+					return client->SendFile(std::move(pFile), nOffset, nLength, std::move(info));
+
+				SendInfoToClient(client, std::move(info));
+				return false;
+			}
+
 			//@param pIngoreClient indicates a specifc client to ignore when sending
 			//info to all clients
 
-			void SendInfoToAllClients(const info<T>& info, std::shared_ptr<Connection<T>> pIgnoreClient = nullptr)
+			void SendInfoToAllClients(const info<T>& info, std::shared_ptr<Connection<T>> pIgnoreClient = nullptr,
+				send_kind kind = send_kind::reliable)
+			{
+				//The info is copied once into a shared, immutable payload rather than once per client
+				SendInfoToAllClients(make_shared_info(info), pIgnoreClient, kind);
+			}
+
+			//The info itself becomes the shared payload, so not even the one copy is made
+			void SendInfoToAllClients(info<T>&& info, std::shared_ptr<Connection<T>> pIgnoreClient = nullptr,
+				send_kind kind = send_kind::reliable)
+			{
+				SendInfoToAllClients(make_shared_info(std::move(info)), pIgnoreClient, kind);
+			}
+
+			//Every client's out queue holds a reference to the same header and body, so the cost of a broadcast
+			//grows with the size of the payload, not with payload times number of clients.
+			void SendInfoToAllClients(shared_info<T> pInfo, std::shared_ptr<Connection<T>> pIgnoreClient = nullptr,
+				send_kind kind = send_kind::reliable)
 			{
-				bool bInvalidClientExists = false;
-				//It is important to notice that we are erasing clients after
-				//having iterating through all the clients in m_deqConnections.
-				//This is because, we don't want to change the m_deqConnections
-				//while iterating since we may invalidate the iterators for the loop
-				//and we would be trouble.
-				for (auto& client : m_deqConnections)
+				//Clients found to be disconnected are only reported once the lock has been released, so that
+				//OnClientDisconnect is free to call back into the server.
+				std::vector<std::shared_ptr<Connection<T>>> vDisconnected;
 				{
-					if (client && client->IsConnected())
+					std::scoped_lock lock(m_muxConnections);
+
+					//The registry keeps its connections packed together, so this walks one contiguous array.
+					//It is important to notice that we are erasing clients after
+					//having iterating through all the clients in m_connections.
+					//This is because erasing moves another client into the erased
+					//one's place and the loop would skip it.
+					for (auto& client : m_connections)
 					{
-						if (client != pIgnoreClient)
-							client->Send(info);
+						if (client->IsConnected())
+						{
+							if (client != pIgnoreClient)
+								client->Send(pInfo, kind);
+						}
+						else if (!HasResumableSession(client->GetID()))
+						{
+							// The client couldn't be contacted, so assume it has
+							//disconnected.
+							vDisconnected.push_back(client);
+						}
 					}
-					else
+
+					for (auto& client : vDisconnected)
 					{
-						// The client couldn't be contacted, so assume it has
-						//disconnected.
-						OnClientDisconnect(client);
-						client.reset();
-						bInvalidClientExists = true;
+						m_connections.erase(client->GetID());
+						m_mapSessions.erase(client->GetID());
 					}
 				}
 
-				if (bInvalidClientExists)
-					m_deqConnections.erase(
-						std::remove(m_deqConnections.begin(), m_deqConnections.end(), nullptr), m_deqConnections.end()
-					);
+				for (auto& client : vDisconnected)
+					ReportDisconnect(client);
 			}
 
 			
+			//Sets the send watermarks and the policy applied once a client falls behind them. Only connections
+			//accepted after the call are affected, so call it before Start().
+			void SetBackpressure(const send_watermarks& watermarks, backpressure_policy policy)
+			{
+				m_watermarks = watermarks;
+				m_nBackpressurePolicy = policy;
+			}
+
+			//Sets how often connections send heartbeats and when a silent or idle client is closed. Only connections
+			//accepted after the call are affected, so call it before Start().
+			void SetHeartbeat(const heartbeat_settings& settings)
+			{
+				m_heartbeat = settings;
+			}
+
+			//Sets the handshake and stalled write deadlines of connections accepted after the call
+			void SetTimeouts(const timeout_settings& settings)
+			{
+				m_timeouts = settings;
+			}
+
+			//Lets a client whose connection drops come back within grace and carry on where it was: with its old
+			//ID, so anything the server keeps per ID survives, and without the validation round trip. Until then it
+			//stays in the registry, detached, and infos sent to it are dropped. Zero, the default, turns sessions
+			//off and a client that drops is removed straight away. Expired sessions are removed, and reported with
+			//OnClientDisconnect, by Update(). Call it before Start().
+			void SetSessionGrace(std::chrono::milliseconds grace)
+			{
+				m_sessionGrace = grace;
+			}
+
+			//Runs OnInfo on a pool of nThreads threads instead of on the thread calling Update(), so that a slow
+			//handler only holds up the client it is handling. Every client has a strand on the pool: its infos are
+			//handled one at a time and in the order they arrived, and its OnClientDisconnect runs after the last of
+			//them, so state kept per client needs no locking. State shared between clients still does. The
+			//resumed connection of a session keeps its client's strand.
+			//Only the default OnInfoBatch uses the pool. 0, the default, keeps OnInfo on the Update() thread. Call
+			//it before Start().
+			void SetInfoWorkers(size_t nThreads)
+			{
+				if (nThreads > 0)
+					m_pInfoWorkers = std::make_unique<asio::thread_pool>(nThreads);
+				else
+					m_pInfoWorkers.reset();
+			}
+
 			void Update(size_t nMaxInfos = -1, bool bWait=false)
 			{
 				//We don't need the server to occupy 100% of a CPU
@@ -207,19 +495,289 @@ namespace tl
 				if (bWait) m_qInfosIn.wait();
 				size_t nInfoCount = 0;
 
-				while (nInfoCount < nMaxInfos && !m_qInfosIn.empty())
+				//Infos are taken off the queue a batch at a time, so the queue's positions are touched once per batch
+				//rather than once per info, and the batch's storage is kept from one call to the next.
+				while (nInfoCount < nMaxInfos)
 				{
-					std::cout << "Calling OnInfo\n";
-					auto info = m_qInfosIn.pop_front();
-					std::cout << "info.remote " << info.remote << " info.info_ " << info.info_ << std::endl;
-					OnInfo(info.remote, info.info_);
-					nInfoCount++;
+					//With OnInfo on the workers, stop taking infos once they are far enough behind. The inbound queue
+					//then fills up and holds the connections back, as it does when Update() itself can't keep up.
+					size_t nRoom = nMaxBatch;
+					if (m_pInfoWorkers)
+					{
+						size_t nPending = m_nWorkerDepth.load(std::memory_order_acquire);
+						nRoom = nPending < nMaxWorkerDepth ? std::min(nMaxBatch, nMaxWorkerDepth - nPending) : 0;
+
+						//The queue isn't empty, so waiting on it again would return at once. Sleep until a worker
+						//has made room instead of spinning round Update().
+						if (nRoom == 0)
+						{
+							if (!bWait)
+								break;
+							m_nWorkerDepth.wait(nPending, std::memory_order_acquire);
+							continue;
+						}
+					}
+
+					m_vBatch.clear();
+					size_t nCount = m_qInfosIn.try_pop_n(std::back_inserter(m_vBatch),
+						std::min(nMaxInfos - nInfoCount, nRoom));
+					if (nCount == 0)
+						break;
+					nInfoCount += nCount;
+
+					uint64_t nNow = SteadyNanoseconds();
+					size_t nRunStart = 0;
+					for (size_t i = 0; i < nCount; i++)
+					{
+						owned_info<T>& info = m_vBatch[i];
+						m_histInboundWait.Record(nNow - info.nQueuedAt);
+
+						//A connection has closed, whether the remote went away, stopped answering heartbeats or
+						//failed a read or write. It is reported here so that OnClientDisconnect runs on the same
+						//thread as OnInfo, after every info the client sent before it went.
+						if (info.info_.header.id == reserved_ids<T>::connection_closed)
+						{
+							if (i > nRunStart)
+								OnInfoBatch(std::span<owned_info<T>>(m_vBatch.data() + nRunStart, i - nRunStart));
+							nRunStart = i + 1;
+
+							if (DropClient(info.remote))
+								ReportDisconnect(info.remote);
+						}
+					}
+
+					if (nCount > nRunStart)
+						OnInfoBatch(std::span<owned_info<T>>(m_vBatch.data() + nRunStart, nCount - nRunStart));
 				}
+
+				//Let go of the connections the batch refers to
+				m_vBatch.clear();
+				ExpireSessions();
 			}
 
 
 
+			//Snapshot of the server's counters, gauges and histograms. Safe to call from any thread, and cheap enough
+			//to call every second.
+			server_stats GetStats()
+			{
+				server_stats s;
+				{
+					std::scoped_lock lock(m_muxConnections);
+					s.vConnections.reserve(m_connections.size());
+					for (auto& client : m_connections)
+						s.vConnections.push_back(client->GetStats());
+				}
+				s.nInboundDepth = m_qInfosIn.size();
+				s.nWorkerDepth = m_nWorkerDepth.load(std::memory_order_relaxed);
+				s.inboundWait = m_histInboundWait.Snapshot();
+				s.bufferPool = buffer_pool::GetStats();
+				s.nLogDropped = logger::GetDropped();
+				return s;
+			}
+
+			//Serves GetStats() over HTTP on 127.0.0.1:port, as text or, for any path containing "json", as JSON:
+			//	curl http://127.0.0.1:port/stats.json
+			//It runs on the first io worker, so call it before or after Start().
+			void StartStatsEndpoint(uint16_t port)
+			{
+				m_pStatsEndpoint = std::make_unique<stats_endpoint>(m_vWorkers.front()->context, port,
+					[this](bool bJson)
+					{
+						server_stats s = GetStats();
+						return bJson ? s.ToJson() : s.ToText();
+					});
+			}
+
+			//Also accepts clients on an AF_UNIX socket at sPath, for client_interface::ConnectLocal. Local clients skip
+			//the TCP/IP stack but are otherwise no different from the ones on the TCP port. Any file already at sPath
+			//is removed first. Only one of ListenLocal and ListenSharedMemory can be used, call it once.
+			bool ListenLocal(const std::string& sPath)
+			{
+				return Listen(sPath, false);
+			}
+
+			//Also accepts clients at sPath that bring shared memory rings with them, for
+			//client_interface::ConnectSharedMemory. Infos then go between the two processes through memory, with no
+			//socket on the way, which only makes sense when both ends are on the same host and trust each other.
+			bool ListenSharedMemory(const std::string& sPath)
+			{
+				return Listen(sPath, true);
+			}
+
 		protected:
+			bool Listen(const std::string& sPath, bool bShm)
+			{
+				try
+				{
+					::unlink(sPath.c_str());
+					m_pLocalAcceptor = std::make_unique<asio::local::stream_protocol::acceptor>(m_vWorkers.front()->context,
+						asio::local::stream_protocol::endpoint(sPath));
+				}
+				catch (std::exception& e)
+				{
+					TL_NET_LOG_ERROR(server, "[SERVER] Can't listen on {}: {}", sPath, e.what());
+					return false;
+				}
+
+				m_sLocalPath = sPath;
+				m_bLocalShm = bShm;
+				asio::co_spawn(m_vWorkers.front()->context, WaitForLocalConnection(), asio::detached);
+				return true;
+			}
+
+			//Removes a client from the registry. Returns false if it had already been removed, or if its place has
+			//been taken by the connection that resumed its session.
+			bool RemoveClient(const std::shared_ptr<Connection<T>>& client)
+			{
+				if (!client)
+					return false;
+				std::scoped_lock lock(m_muxConnections);
+				std::shared_ptr<Connection<T>>* pClient = m_connections.find(client->GetID());
+				if (!pClient || *pClient != client)
+					return false;
+				m_mapSessions.erase(client->GetID());
+				return m_connections.erase(client->GetID());
+			}
+
+			//Deals with a client found to be disconnected. One that may still resume its session is only marked
+			//detached; anything else is removed. Returns true if the client was removed, in which case the caller
+			//reports it with OnClientDisconnect.
+			bool DropClient(const std::shared_ptr<Connection<T>>& client)
+			{
+				if (!client)
+					return false;
+				{
+					std::scoped_lock lock(m_muxConnections);
+					std::shared_ptr<Connection<T>>* pClient = m_connections.find(client->GetID());
+					if (!pClient || *pClient != client)
+						return false;
+
+					auto it = m_mapSessions.find(client->GetID());
+					if (m_sessionGrace.count() > 0 && it != m_mapSessions.end())
+					{
+						if (!client->IsDetached())
+						{
+							TL_NET_LOG_INFO(server, "[{}] Client detached, session kept for {} ms", client->GetID(),
+								m_sessionGrace.count());
+							client->SetDetached(true);
+							it->second.nDetachedAt = SteadyNanoseconds();
+						}
+						return false;
+					}
+				}
+				return RemoveClient(client);
+			}
+
+			//Removes the clients that have been detached for longer than the grace period
+			void ExpireSessions()
+			{
+				if (m_sessionGrace.count() <= 0)
+					return;
+
+				uint64_t nNow = SteadyNanoseconds();
+				uint64_t nGrace = uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(m_sessionGrace).count());
+				std::vector<std::shared_ptr<Connection<T>>> vExpired;
+				{
+					std::scoped_lock lock(m_muxConnections);
+					for (auto it = m_mapSessions.begin(); it != m_mapSessions.end();)
+					{
+						if (it->second.nDetachedAt == 0 || nNow - it->second.nDetachedAt < nGrace)
+						{
+							++it;
+							continue;
+						}
+
+						if (std::shared_ptr<Connection<T>>* pClient = m_connections.find(it->first))
+						{
+							vExpired.push_back(*pClient);
+							m_connections.erase(it->first);
+						}
+						it = m_mapSessions.erase(it);
+					}
+				}
+
+				for (auto& client : vExpired)
+				{
+					TL_NET_LOG_INFO(server, "[{}] Session expired", client->GetID());
+					ReportDisconnect(client);
+				}
+			}
+
+			//A client's strand on the workers
+			struct client_strand
+			{
+				client_strand(asio::strand<asio::thread_pool::executor_type> s) : strand(std::move(s)) {}
+
+				asio::strand<asio::thread_pool::executor_type> strand;
+				//Handlers ever posted to the strand, so a disconnect can tell whether it was the last
+				uint64_t nPosted = 0;
+			};
+
+			//Hands each info to the strand of the client it came from
+			void DispatchToWorkers(std::span<owned_info<T>> batch)
+			{
+				m_nWorkerDepth.fetch_add(batch.size(), std::memory_order_relaxed);
+
+				std::scoped_lock lock(m_muxStrands);
+				for (owned_info<T>& info : batch)
+				{
+					//The strand is looked up before the lambda is made, which moves info.remote away
+					auto& strand = StrandOf(info.remote->GetID());
+					strand.nPosted++;
+					asio::post(strand.strand, [this, info = std::move(info)]() mutable
+						{
+							OnInfo(info.remote, info.info_);
+
+							//Update() sleeps on the depth once it reaches the limit
+							if (m_nWorkerDepth.fetch_sub(1, std::memory_order_release) >= nMaxWorkerDepth)
+								m_nWorkerDepth.notify_all();
+						});
+				}
+			}
+
+			//Only called with m_muxStrands held
+			client_strand& StrandOf(uint32_t nID)
+			{
+				auto it = m_mapStrands.find(nID);
+				if (it == m_mapStrands.end())
+					it = m_mapStrands.try_emplace(nID, asio::make_strand(m_pInfoWorkers->get_executor())).first;
+				return it->second;
+			}
+
+			//Calls OnClientDisconnect for a client that has been removed. With OnInfo on the workers it is queued
+			//behind the client's infos on its strand. The strand is only forgotten once the handler has run, and
+			//only if nothing was posted to it since, so no info for that ID can start on a new strand while the
+			//old one is still busy with it.
+			void ReportDisconnect(std::shared_ptr<Connection<T>> client)
+			{
+				if (!m_pInfoWorkers)
+				{
+					OnClientDisconnect(client);
+					return;
+				}
+
+				std::scoped_lock lock(m_muxStrands);
+				uint32_t nID = client->GetID();
+				client_strand& strand = StrandOf(nID);
+				uint64_t nPosted = ++strand.nPosted;
+				asio::post(strand.strand, [this, nID, nPosted, client = std::move(client)]()
+					{
+						OnClientDisconnect(client);
+
+						std::scoped_lock lock(m_muxStrands);
+						auto it = m_mapStrands.find(nID);
+						if (it != m_mapStrands.end() && it->second.nPosted == nPosted)
+							m_mapStrands.erase(it);
+					});
+			}
+
+			//Only called with m_muxConnections held
+			bool HasResumableSession(uint32_t nID) const
+			{
+				return m_sessionGrace.count() > 0 && m_mapSessions.count(nID) != 0;
+			}
+
 			// Called when a client connects, you can veto the connection
 			// by returning false
 			// Here we can put in a check for max number of clients or we can check
@@ -239,10 +797,30 @@ namespace tl
 			// Called when an info arrives
 			virtual void OnInfo(std::shared_ptr<tl::net::Connection<T>> client, tl::net::info<T>& info)
 			{
-				std::cout << "net_server onInfo called\n";
+				TL_NET_LOG_DEBUG(server, "net_server onInfo called");
 				
 			}
 
+			//Called by Update() with every info taken off the inbound queue in one go. Infos from one client are in
+			//the order it sent them, but those of different clients are interleaved. Override it to deal with a
+			//batch as a whole, e.g. to handle all the chunks a client has sent before acknowledging any of them;
+			//the infos may be moved out of. By default each info goes to OnInfo in turn.
+			virtual void OnInfoBatch(std::span<owned_info<T>> batch)
+			{
+				if (m_pInfoWorkers)
+				{
+					DispatchToWorkers(batch);
+					return;
+				}
+
+				for (owned_info<T>& info : batch)
+				{
+					TL_NET_LOG_TRACE(server, "[{}] Calling OnInfo for info {} of {} bytes",
+						info.remote ? info.remote->GetID() : 0, info.info_.header.id, info.info_.header.size);
+					OnInfo(info.remote, info.info_);
+				}
+			}
+
 		public:
 
 			//Called when a client is validated
@@ -251,21 +829,83 @@ namespace tl
 
 			}
 
-		protected:
-			//Threadsafe Queue for incoming info packets
-			threadsafeQueue<owned_info<T>> m_qInfosIn;
+			//Called when a client has come back and resumed its session. client is a new connection, but has the ID
+			//of the one it replaces and OnClientDisconnect is not called for that one.
+			virtual void OnClientResumed(std::shared_ptr<Connection<T>> client)
+			{
+
+			}
+
+			//Called by a connection once its client is validated. Returns the token the client may later resume the
+			//session with, or an invalid token when sessions are off.
+			session_token OpenSession(const std::shared_ptr<Connection<T>>& client)
+			{
+				if (m_sessionGrace.count() <= 0)
+					return {};
+
+				std::scoped_lock lock(m_muxConnections);
+				session_token token;
+				token.nID = client->GetID();
+				//The secret is what proves the session is the client's, so every one is drawn fresh from the kernel's
+				//CSPRNG. A seeded generator would let a client that sees its own secret work out everyone else's.
+				do
+					token.nSecret = NewSessionSecret();
+				while (token.nSecret == 0);
+				m_mapSessions[token.nID] = { token.nSecret, 0 };
+				return token;
+			}
 
-			//Conatiner of active validated connections
-			std::deque<std::shared_ptr<Connection<T>>> m_deqConnections;
+			static uint64_t NewSessionSecret()
+			{
+				uint64_t nSecret = 0;
+				if (getrandom(&nSecret, sizeof(nSecret), 0) == ssize_t(sizeof(nSecret)))
+					return nSecret;
+
+				//Only if getrandom() isn't there. random_device reads the same kernel source, 32 bits at a time.
+				std::random_device rd;
+				return (uint64_t(rd()) << 32) | rd();
+			}
+
+			//Called by a new connection that presents token instead of validating. If the session is still there,
+			//the new connection takes the old one's place in the registry, the old one is closed if it wasn't
+			//already, and the ID is returned. Returns 0 if the session can't be resumed.
+			uint32_t ResumeSession(const std::shared_ptr<Connection<T>>& client, const session_token& token)
+			{
+				std::shared_ptr<Connection<T>> pOld;
+				{
+					std::scoped_lock lock(m_muxConnections);
+					auto it = m_mapSessions.find(token.nID);
+					if (it == m_mapSessions.end() || it->second.nSecret != token.nSecret)
+						return 0;
+
+					std::shared_ptr<Connection<T>>* pSlot = m_connections.find(token.nID);
+					if (!pSlot)
+						return 0;
+
+					pOld = std::move(*pSlot);
+					*pSlot = client;
+					//The slot the new connection was given on accept is no longer needed
+					m_connections.erase(client->GetID());
+					it->second.nDetachedAt = 0;
+				}
+
+				//The server may not have noticed yet that the old connection dropped
+				pOld->SetDetached(true);
+				pOld->Disconnect();
+				return token.nID;
+			}
+
+			//Called when a client's send queue goes above its high watermark (bCongested is true) and again once
+			//it has drained to its low watermark. It runs on whichever thread happened to send or drain, so it
+			//must be threadsafe.
+			virtual void OnBackpressure(std::shared_ptr<Connection<T>> client, bool bCongested)
+			{
 
-			//The context is shared across all connected clients
-			asio::io_context m_asioContext;
-			//ASIO Contexts need a thread
-			std::thread m_threadContext;
+			}
 
-			//Here we get the sockets of the connected clients which needs an ASIO
-			//context
-			asio::ip::tcp::acceptor m_asioAcceptor;
+		protected:
+			//Threadsafe Queue for incoming info packets. Every connection pushes into it, only Update() pops from it.
+			inbound_queue_t<T> m_qInfosIn;
 
 			//Clients will be identified in the "wider system" via an ID
 			//Every client will have a unique identifier.
@@ -276,8 +916,59 @@ namespace tl
 			//can be used as an identifier, we are not comfortable to sending out that data
 			//to the clients. We will also notice that a numeric address is also simpler 
 			//to work with rather than an ip-address
-			uint32_t nIDCounter = 10000;
-
+			//The ID is the connection's key in m_connections: the low bits are its slot and the high bits count how
+			//many times that slot has been reused, so an ID kept after its client has gone never finds the client
+			//that took the slot over.
+			//
+			//Registry of active validated connections, keyed by their ID
+			slotMap<std::shared_ptr<Connection<T>>> m_connections;
+			std::mutex m_muxConnections;
+
+			std::vector<std::unique_ptr<io_worker>> m_vWorkers;
+			send_watermarks m_watermarks;
+			backpressure_policy m_nBackpressurePolicy = backpressure_policy::drop_oldest;
+			heartbeat_settings m_heartbeat;
+			timeout_settings m_timeouts;
+
+			//Time infos spent in m_qInfosIn, only ever recorded by the thread calling Update()
+			histogram m_histInboundWait;
+			//The infos Update() is handing out, only ever touched by the thread calling Update()
+			std::vector<owned_info<T>> m_vBatch;
+			static constexpr size_t nMaxBatch = 256;
+
+			//Runs OnInfo when SetInfoWorkers has been called, with a strand per client ID guarded by m_muxStrands
+			std::unique_ptr<asio::thread_pool> m_pInfoWorkers;
+			std::unordered_map<uint32_t, client_strand> m_mapStrands;
+			std::mutex m_muxStrands;
+			//Infos posted to the workers and not yet handled, at most nMaxWorkerDepth
+			std::atomic<size_t> m_nWorkerDepth{ 0 };
+			static constexpr size_t nMaxWorkerDepth = 8192;
+			//Declared after m_vWorkers so that it is destroyed before the context it runs on
+			std::unique_ptr<stats_endpoint> m_pStatsEndpoint;
+			//Accepts local clients on the first worker, see ListenLocal. Also destroyed before the workers.
+			std::unique_ptr<asio::local::stream_protocol::acceptor> m_pLocalAcceptor;
+			std::string m_sLocalPath;
+			bool m_bLocalShm = false;
+
+			//Sessions that may be resumed, keyed by client ID, guarded by m_muxConnections
+			struct session_entry
+			{
+				uint64_t nSecret = 0;
+				//When the client's connection was found to have dropped, 0 while it is attached
+				uint64_t nDetachedAt = 0;
+			};
+			std::unordered_map<uint32_t, session_entry> m_mapSessions;
+			std::chrono::milliseconds m_sessionGrace{ 0 };
+
+			//Next worker to hand a connection to when one acceptor serves them all
+			size_t m_nNextWorker = 0;
+
+#if defined(SO_REUSEPORT)
+			using reuse_port = asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>;
+			static constexpr bool bShardedAccept = true;
+#else
+			static constexpr bool bShardedAccept = false;
+#endif
 		};
 	}
 }
@@ -0,0 +1,162 @@
+#ifndef NET_SLOTMAP_HPP
+#define NET_SLOTMAP_HPP
+/*
+	net_slotMap.hpp
+
+	The server needs to find a client by its ID, drop it when it disconnects and walk every client for a broadcast,
+	all while thousands of clients come and go. A slot map does all three in constant time:
+
+	  key = | generation (12 bits) | slot index (20 bits) |
+	                                        |
+	                                        v
+	  slots:   | gen 3, dense 1 | gen 7, free  | gen 1, dense 0 | ...     one per key ever handed out, reused
+	                    |                              |
+	                    v                              v
+	  dense:   | value of slot 2 | value of slot 0 |                      packed, iterated for broadcasts
+
+	- insert takes a free slot (or a new one), puts the value at the end of the dense array and returns a key made of
+	  the slot index and the slot's current generation.
+	- find checks that the generation in the key still matches the slot, so a key for a value that has since been
+	  erased finds nothing, even if the slot is now used by something else.
+	- erase moves the last dense value into the hole, bumps the slot's generation and puts the slot on the free list.
+
+	A slot's generation wraps after 4096 reuses, so a key kept that long after its value was erased could match again.
+	Keys are never 0, which leaves 0 free to mean "no key".
+
+	The slot map does no locking of its own.
+*/
+
+#include "net_base.h"
+
+namespace tl
+{
+	namespace net
+	{
+		template<typename V>
+		class slotMap
+		{
+			public:
+				using key = uint32_t;
+
+				static constexpr uint32_t nIndexBits = 20;
+				static constexpr uint32_t nIndexMask = (1u << nIndexBits) - 1;
+				static constexpr uint32_t nMaxGeneration = (1u << (32 - nIndexBits)) - 1;
+
+				//Adds value and returns the key to find it again. Returns 0 if every slot is taken.
+				key insert(V value)
+				{
+					uint32_t nSlot;
+					if (m_nFreeHead != nNone)
+					{
+						nSlot = m_nFreeHead;
+						m_nFreeHead = m_vSlots[nSlot].nNext;
+					}
+					else
+					{
+						if (m_vSlots.size() > nIndexMask)
+							return 0;
+						nSlot = uint32_t(m_vSlots.size());
+						m_vSlots.push_back({});
+					}
+
+					slot& s = m_vSlots[nSlot];
+					s.nNext = uint32_t(m_vDense.size());
+					m_vDense.push_back(std::move(value));
+					m_vDenseToSlot.push_back(nSlot);
+
+					return MakeKey(nSlot, s.nGeneration);
+				}
+
+				//Returns the value for k, or nullptr if it has been erased
+				V* find(key k)
+				{
+					uint32_t nSlot = k & nIndexMask;
+					if (nSlot >= m_vSlots.size() || m_vSlots[nSlot].nGeneration != (k >> nIndexBits))
+						return nullptr;
+
+					//A free slot already carries the generation its next value will get, so the generation alone
+					//doesn't say the slot is in use. Only an occupied slot is pointed back at by its dense entry.
+					uint32_t nDense = m_vSlots[nSlot].nNext;
+					if (nDense >= m_vDense.size() || m_vDenseToSlot[nDense] != nSlot)
+						return nullptr;
+					return &m_vDense[nDense];
+				}
+
+				//Removes the value for k. Returns false if it was already gone.
+				bool erase(key k)
+				{
+					if (!find(k))
+						return false;
+
+					uint32_t nSlot = k & nIndexMask;
+					slot& s = m_vSlots[nSlot];
+					uint32_t nDense = s.nNext;
+
+					//Fill the hole with the last value so the dense array stays packed
+					if (nDense != m_vDense.size() - 1)
+					{
+						m_vDense[nDense] = std::move(m_vDense.back());
+						m_vDenseToSlot[nDense] = m_vDenseToSlot.back();
+						m_vSlots[m_vDenseToSlot[nDense]].nNext = nDense;
+					}
+					m_vDense.pop_back();
+					m_vDenseToSlot.pop_back();
+
+					//Any key still holding the old generation is now stale. Generation 0 is skipped so no key is 0.
+					s.nGeneration = s.nGeneration == nMaxGeneration ? 1 : s.nGeneration + 1;
+					s.nNext = m_nFreeHead;
+					m_nFreeHead = nSlot;
+					return true;
+				}
+
+				size_t size() const
+				{
+					return m_vDense.size();
+				}
+
+				bool empty() const
+				{
+					return m_vDense.empty();
+				}
+
+				//Iteration walks the packed values in no particular order
+				typename std::vector<V>::iterator begin()
+				{
+					return m_vDense.begin();
+				}
+
+				typename std::vector<V>::iterator end()
+				{
+					return m_vDense.end();
+				}
+
+				void clear()
+				{
+					for (size_t i = m_vDenseToSlot.size(); i-- > 0;)
+						erase(MakeKey(m_vDenseToSlot[i], m_vSlots[m_vDenseToSlot[i]].nGeneration));
+				}
+
+			protected:
+				static constexpr uint32_t nNone = 0xFFFFFFFF;
+
+				struct slot
+				{
+					uint32_t nGeneration = 1;
+					//Index into m_vDense while the slot is in use, next free slot while it isn't
+					uint32_t nNext = nNone;
+				};
+
+				static key MakeKey(uint32_t nSlot, uint32_t nGeneration)
+				{
+					return (nGeneration << nIndexBits) | nSlot;
+				}
+
+				std::vector<slot> m_vSlots;
+				std::vector<V> m_vDense;
+				std::vector<uint32_t> m_vDenseToSlot;
+				uint32_t m_nFreeHead = nNone;
+		};
+	}
+}
+
+#endif
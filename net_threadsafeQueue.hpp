@@ -27,6 +27,7 @@
 */
 
 #include "net_base.h"
+#include "net_readiness.hpp"
 
 namespace tl
 {
@@ -69,29 +70,63 @@ namespace tl
 					return deqQueue.back();
 				}
 
-				// Adds an item to back of queue
-				void push_back(const T& item)
+				//Returns and maintains the item at position i from the front of the Queue.
+				//The reference stays valid while items are added at either end, but not once the item itself is removed.
+				const T& at(size_t i)
 				{
-					//To prevent anything else from running while adding item to back of queue
 					std::scoped_lock lock(muxQueue);
-					deqQueue.emplace_back(std::move(item));
+					return deqQueue.at(i);
+				}
+
+				// Adds a copy of an item to back of queue
+				void push_back(const T& item)
+				{
+					emplace_back(item);
+				}
+
+				// Moves an item to back of queue, so an info's body changes hands instead of being copied
+				void push_back(T&& item)
+				{
+					emplace_back(std::move(item));
+				}
+
+				// Constructs an item in place at back of queue
+				template<typename... Args>
+				void emplace_back(Args&&... args)
+				{
+					{
+						//To prevent anything else from running while adding item to back of queue
+						std::scoped_lock lock(muxQueue);
+						deqQueue.emplace_back(std::forward<Args>(args)...);
+					}
 
 					//To signal cvBlocking variable to wake up when an item is added to back of the queue
-					std::unique_lock<std::mutex> ul(muxBlocking);
-					cvBlocking.notify_one();
+					notify();
 				}
 
 				//Adds item to front of Queue
 
 				void push_front(const T& item)
 				{
-					//To prevent anything else from running while adding item to front of queue
-					std::scoped_lock lock(muxQueue);
-					deqQueue.emplace_front(std::move(item));
+					emplace_front(item);
+				}
+
+				void push_front(T&& item)
+				{
+					emplace_front(std::move(item));
+				}
+
+				template<typename... Args>
+				void emplace_front(Args&&... args)
+				{
+					{
+						//To prevent anything else from running while adding item to front of queue
+						std::scoped_lock lock(muxQueue);
+						deqQueue.emplace_front(std::forward<Args>(args)...);
+					}
 
 					//To signal cvBlocking variable to wake up when an item is added at front of the queue
-					std::unique_lock<std::mutex> ul(muxBlocking);
-					cvBlocking.notify_one();
+					notify();
 				}
 
 				//Returns if Queue has no items
@@ -140,11 +175,70 @@ namespace tl
 					return t; 
 				}
 
+				//Removes the items from position nFrom onwards for which pred returns true. Items are offered to pred
+				//oldest first, so pred may keep count and stop removing once it has removed enough.
+				//Returns how many items were removed.
+				template<typename Pred>
+				size_t erase_if(size_t nFrom, Pred pred)
+				{
+					std::scoped_lock lock(muxQueue);
+					size_t nRemoved = 0;
+
+					for (auto it = deqQueue.begin() + std::min(nFrom, deqQueue.size()); it != deqQueue.end();)
+					{
+						if (pred(*it))
+						{
+							it = deqQueue.erase(it);
+							nRemoved++;
+						}
+						else
+							++it;
+					}
+
+					return nRemoved;
+				}
+
+				//Removes up to nMax items from the front of the Queue and writes them to out, taking the lock only once.
+				//Returns how many items were removed.
+				template<typename OutputIt>
+				size_t try_pop_n(OutputIt out, size_t nMax)
+				{
+					std::scoped_lock lock(muxQueue);
+					size_t nCount = std::min(nMax, deqQueue.size());
+					std::move(deqQueue.begin(), deqQueue.begin() + nCount, out);
+					deqQueue.erase(deqQueue.begin(), deqQueue.begin() + nCount);
+					return nCount;
+				}
+
+				//Pokes pEvent as well as waking wait() whenever an item is added, so the queue can be watched from a
+				//poll loop. Set it before any other thread uses the queue.
+				void set_notify(readiness_event* pEvent)
+				{
+					m_pNotify = pEvent;
+				}
+
+				//Wakes whoever waits on the queue without adding anything, e.g. to let them see a connection close.
+				//Never call it with muxQueue held: wait() holds muxBlocking while it takes muxQueue, so taking them
+				//the other way round here could deadlock a producer against the consumer.
+				void notify()
+				{
+					{
+						std::unique_lock<std::mutex> ul(muxBlocking);
+						cvBlocking.notify_one();
+					}
+
+					if (m_pNotify)
+						m_pNotify->Notify();
+				}
+
 				void wait()
 				{
+					//muxBlocking must be held while we check for emptiness. Producers take it before they notify, so
+					//a push can't land between our check and the wait below and leave us asleep with an item queued.
+					//The lock order is always muxBlocking then muxQueue; producers let go of muxQueue before notify().
+					std::unique_lock<std::mutex> ul(muxBlocking);
 					while (empty())
 					{
-						std::unique_lock<std::mutex> ul(muxBlocking);
 						//Sends the thread to sleep
 						//cvBlocking will wait here until something
 						//signals the cvBlocking variable to wake up
@@ -167,6 +261,7 @@ namespace tl
 				std::condition_variable cvBlocking;
 				//Used to protext the cvBlocking variable
 				std::mutex muxBlocking;
+				readiness_event* m_pNotify = nullptr;
 		};
 	}
 }
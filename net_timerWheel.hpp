@@ -0,0 +1,254 @@
+#ifndef NET_TIMERWHEEL_HPP
+#define NET_TIMERWHEEL_HPP
+/*
+	net_timerWheel.hpp
+
+	Every connection needs a few deadlines: the handshake has to be answered, heartbeats have to go out and a write
+	that stops making progress has to be given up on. An asio::steady_timer for each of those costs a heap node in
+	asio's timer queue and a trip through its heap on every arm and cancel, and with 100k connections re-arming on
+	every write that adds up.
+
+	timer_wheel keeps all the deadlines of one io_context in a hierarchical timing wheel, driven by a single
+	steady_timer that ticks every nTickMs while anything is armed:
+
+	 level 0   | 0 | 1 | 2 | ... | 63 |     one slot per tick              up to 640 ms ahead
+	 level 1   | 0 | 1 | 2 | ... | 63 |     one slot per 64 ticks          up to 41 s ahead
+	 level 2   | 0 | 1 | 2 | ... | 63 |     one slot per 64^2 ticks        up to 44 min ahead
+	 level 3   | 0 | 1 | 2 | ... | 63 |     one slot per 64^3 ticks        up to 46 h ahead
+
+	- A timer goes into the slot for its expiry on the lowest level that reaches that far. Each slot is an intrusive
+	  doubly linked list, so arming and cancelling are a handful of pointer writes, whatever the number of timers.
+	- Each tick runs everything in the current level 0 slot. Whenever level 0 wraps around, the next slot of level 1
+	  is emptied and its timers go back in one level lower, and so on up the levels.
+
+	The wheel is an asio service, so there is exactly one per io_context, created the first time it is used:
+
+	    timer_wheel& wheel = asio::use_service<timer_wheel>(context);
+
+	It must only be used from the thread running that context. Timers expire up to one tick late.
+*/
+
+#include "net_base.h"
+#include <functional>
+
+namespace tl
+{
+	namespace net
+	{
+		class timer_wheel;
+
+		//A deadline on a timer_wheel. The callback is bound once and the timer armed and cancelled as often as
+		//needed after that. Destroying an armed timer cancels it.
+		class wheel_timer
+		{
+			public:
+				wheel_timer() = default;
+				wheel_timer(const wheel_timer&) = delete;
+				wheel_timer& operator=(const wheel_timer&) = delete;
+
+				~wheel_timer()
+				{
+					Cancel();
+				}
+
+				void Bind(timer_wheel& wheel, std::function<void()> fnExpire)
+				{
+					Cancel();
+					m_pWheel = &wheel;
+					m_fnExpire = std::move(fnExpire);
+				}
+
+				//Runs the callback once delay has passed, replacing any earlier deadline
+				inline void Arm(std::chrono::milliseconds delay);
+
+				inline void Cancel();
+
+				bool IsArmed() const
+				{
+					return m_pPrev != nullptr;
+				}
+
+			protected:
+				friend class timer_wheel;
+
+				timer_wheel* m_pWheel = nullptr;
+				std::function<void()> m_fnExpire;
+				wheel_timer* m_pPrev = nullptr;
+				wheel_timer* m_pNext = nullptr;
+				uint64_t m_nExpiry = 0;
+		};
+
+		class timer_wheel : public asio::execution_context::service
+		{
+			public:
+				using key_type = timer_wheel;
+				inline static asio::execution_context::id id;
+
+				static constexpr uint64_t nTickMs = 10;
+				static constexpr size_t nSlotBits = 6;
+				static constexpr size_t nSlots = size_t(1) << nSlotBits;
+				static constexpr size_t nLevels = 4;
+
+				explicit timer_wheel(asio::execution_context& context)
+					: asio::execution_context::service(context), m_timer(static_cast<asio::io_context&>(context))
+				{
+					for (auto& level : m_vSlots)
+						for (auto& slot : level)
+							slot.m_pPrev = slot.m_pNext = &slot;
+				}
+
+				void Arm(wheel_timer& t, std::chrono::milliseconds delay)
+				{
+					Unlink(t);
+
+					if (m_nArmed == 0)
+					{
+						//Nothing was ticking, so bring the wheel up to date before measuring from it
+						m_tStart = std::chrono::steady_clock::now() - std::chrono::milliseconds(m_nNow * nTickMs);
+					}
+
+					uint64_t nTicks = (uint64_t(std::max<int64_t>(delay.count(), 0)) + nTickMs - 1) / nTickMs;
+					t.m_nExpiry = m_nNow + std::max<uint64_t>(nTicks, 1);
+					Link(t);
+
+					if (m_nArmed++ == 0)
+						ScheduleTick();
+				}
+
+				void Cancel(wheel_timer& t)
+				{
+					if (t.IsArmed())
+					{
+						Unlink(t);
+						m_nArmed--;
+					}
+				}
+
+				size_t GetArmedCount() const
+				{
+					return m_nArmed;
+				}
+
+			protected:
+				void shutdown() override
+				{
+					m_timer.cancel();
+					for (auto& level : m_vSlots)
+						for (auto& slot : level)
+							while (slot.m_pNext != &slot)
+								Unlink(*slot.m_pNext);
+					m_nArmed = 0;
+				}
+
+				//Puts t in the slot for its expiry on the lowest level that reaches that far ahead
+				void Link(wheel_timer& t)
+				{
+					uint64_t nDelta = t.m_nExpiry - m_nNow;
+					size_t nLevel = 0;
+					while (nLevel + 1 < nLevels && nDelta >= (uint64_t(1) << (nSlotBits * (nLevel + 1))))
+						nLevel++;
+
+					//Anything further ahead than the top level reaches waits in its last slot and is looked at again
+					//when that comes round
+					uint64_t nExpiry = std::min(t.m_nExpiry, m_nNow + (uint64_t(1) << (nSlotBits * nLevels)) - 1);
+					wheel_timer& slot = m_vSlots[nLevel][(nExpiry >> (nSlotBits * nLevel)) & (nSlots - 1)];
+
+					t.m_pPrev = &slot;
+					t.m_pNext = slot.m_pNext;
+					slot.m_pNext->m_pPrev = &t;
+					slot.m_pNext = &t;
+				}
+
+				static void Unlink(wheel_timer& t)
+				{
+					if (!t.m_pPrev)
+						return;
+					t.m_pPrev->m_pNext = t.m_pNext;
+					t.m_pNext->m_pPrev = t.m_pPrev;
+					t.m_pPrev = t.m_pNext = nullptr;
+				}
+
+				void ScheduleTick()
+				{
+					m_timer.expires_at(m_tStart + std::chrono::milliseconds((m_nNow + 1) * nTickMs));
+					m_timer.async_wait([this](std::error_code ec)
+						{
+							if (ec)
+								return;
+
+							//Catch up on every tick that has passed, the io thread may have been busy
+							uint64_t nTarget = uint64_t(std::chrono::duration_cast<std::chrono::milliseconds>(
+								std::chrono::steady_clock::now() - m_tStart).count()) / nTickMs;
+							while (m_nNow < nTarget && m_nArmed > 0)
+								Tick();
+							if (m_nArmed > 0)
+							{
+								m_nNow = std::max(m_nNow, nTarget);
+								ScheduleTick();
+							}
+						});
+				}
+
+				void Tick()
+				{
+					m_nNow++;
+
+					//When a level wraps around, the slot of the level above that has now come round is spread out
+					//over the levels below
+					for (size_t nLevel = 1; nLevel < nLevels; nLevel++)
+					{
+						if ((m_nNow & ((uint64_t(1) << (nSlotBits * nLevel)) - 1)) != 0)
+							break;
+						wheel_timer& slot = m_vSlots[nLevel][(m_nNow >> (nSlotBits * nLevel)) & (nSlots - 1)];
+						while (slot.m_pNext != &slot)
+						{
+							wheel_timer& t = *slot.m_pNext;
+							Unlink(t);
+							Link(t);
+						}
+					}
+
+					wheel_timer& slot = m_vSlots[0][m_nNow & (nSlots - 1)];
+					while (slot.m_pNext != &slot)
+					{
+						wheel_timer& t = *slot.m_pNext;
+						Unlink(t);
+
+						//Only a timer clamped to the top level can come round before its time
+						if (t.m_nExpiry > m_nNow)
+						{
+							Link(t);
+							continue;
+						}
+
+						m_nArmed--;
+						//The callback may re-arm or rebind its own timer, or destroy whatever owns it, so it is run
+						//from a copy
+						std::function<void()> fnExpire = t.m_fnExpire;
+						fnExpire();
+					}
+				}
+
+				//Slot heads are timers themselves, so linking and unlinking never has to check for the ends of a list
+				std::array<std::array<wheel_timer, nSlots>, nLevels> m_vSlots;
+				uint64_t m_nNow = 0;
+				size_t m_nArmed = 0;
+				std::chrono::steady_clock::time_point m_tStart = std::chrono::steady_clock::now();
+				asio::steady_timer m_timer;
+		};
+
+		void wheel_timer::Arm(std::chrono::milliseconds delay)
+		{
+			if (m_pWheel)
+				m_pWheel->Arm(*this, delay);
+		}
+
+		void wheel_timer::Cancel()
+		{
+			if (m_pWheel)
+				m_pWheel->Cancel(*this);
+		}
+	}
+}
+
+#endif
@@ -0,0 +1,689 @@
+#ifndef NET_TRANSPORT_HPP
+#define NET_TRANSPORT_HPP
+/*
+	net_transport.hpp
+
+	What a Connection reads its infos from and writes them to. The framing, the handshake and everything above stay
+	the same whichever one is used:
+
+	 tcp            asio::ip::tcp, between machines                        client_interface::Connect
+	 local          AF_UNIX stream socket, same host, no TCP/IP stack      client_interface::ConnectLocal
+	 shared memory  two rings in memory shared by both processes,          client_interface::ConnectSharedMemory
+	                with eventfd doorbells, no socket on the data path
+
+	TCP and AF_UNIX sockets are both held as an asio::generic::stream_protocol::socket, so apart from TCP_NODELAY
+	they are used the same way. The shared memory transport is shm_channel below. transport_stream wraps either and
+	has the async_read_some/async_write_some of an asio stream, so asio::async_read and asio::async_write work on it.
+
+	Shared memory
+	-------------
+	The client creates a memfd holding two single producer / single consumer byte rings, one per direction, and four
+	eventfds, then hands all five descriptors to the server over an AF_UNIX socket (SCM_RIGHTS):
+
+	  memfd:  | control c->s | control s->c | ring c->s (nRingBytes) | ring s->c (nRingBytes) |
+
+	  control: nWrite (bytes ever written)   bReaderWaiting   \  each on its own cache line, so writer and reader
+	           nRead  (bytes ever read)      bWriterWaiting   /  don't take the line from each other on every info
+	           bClosed
+
+	- Writing copies into the ring and publishes nWrite. Reading copies out and publishes nRead. Neither takes a lock
+	  or makes a system call while the other side keeps up.
+	- A reader that finds its ring empty sets bReaderWaiting, looks once more and then sleeps on the ring's data
+	  eventfd through the io_context. The writer rings that doorbell only if it finds bReaderWaiting set, and clears
+	  it, so a busy ring costs no system calls at all. Full rings work the same way with bWriterWaiting and the space
+	  eventfd.
+	- Closing sets bClosed on the outgoing ring and rings both doorbells. The AF_UNIX socket is kept open only to
+	  find out if the other process dies without closing.
+
+	Either process can write anything into the shared memory, so the server checks what a client hands it before
+	using it:
+	- The memfd must be sealed against shrinking and growing. Otherwise the client could shrink it after the server
+	  has mapped it, and the server's next access would die with SIGBUS.
+	- Every doorbell must be an eventfd, and is made non-blocking. A pipe that is full could otherwise block the
+	  worker thread in write().
+	- Ring positions read from the memory are clamped to the ring's size.
+	With those checks a misbehaving client can garble the infos of its own connection, or keep its worker busy by
+	ringing doorbells, as a TCP client can by sending, but it can't crash or stall the server.
+*/
+
+#include "net_base.h"
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <cstring>
+#include <fcntl.h>
+
+namespace tl
+{
+	namespace net
+	{
+		enum class transport_kind
+		{
+			tcp,
+			local,
+			shared_memory
+		};
+
+		//TCP or AF_UNIX, decided when the socket is opened
+		using stream_socket = asio::generic::stream_protocol::socket;
+
+		//Bytes in each direction's ring, enough for a burst of media infos without the writer having to wait
+		constexpr size_t nDefaultRingBytes = size_t(1) << 20;
+
+		//The shared part of one ring. Lives in the memfd, so it must not hold pointers.
+		struct shm_ring_control
+		{
+			alignas(64) std::atomic<uint64_t> nWrite{ 0 };
+			std::atomic<uint32_t> bReaderWaiting{ 0 };
+			std::atomic<uint32_t> bClosed{ 0 };
+			alignas(64) std::atomic<uint64_t> nRead{ 0 };
+			std::atomic<uint32_t> bWriterWaiting{ 0 };
+		};
+
+		//One direction of a shm_channel, as seen by one side
+		class shm_ring
+		{
+			public:
+				void Attach(shm_ring_control* pControl, uint8_t* pData, size_t nBytes)
+				{
+					m_pControl = pControl;
+					m_pData = pData;
+					m_nMask = nBytes - 1;
+				}
+
+				shm_ring_control& Control()
+				{
+					return *m_pControl;
+				}
+
+				//Copies as much of buffers as there is room for into the ring and returns how many bytes that was.
+				//Producer only.
+				template<typename ConstBufferSequence>
+				size_t Write(const ConstBufferSequence& buffers)
+				{
+					uint64_t nWrite = m_pControl->nWrite.load(std::memory_order_relaxed);
+					size_t nRoom = Capacity() - Used(nWrite, m_pControl->nRead.load(std::memory_order_acquire));
+					size_t nTotal = 0;
+
+					for (auto it = asio::buffer_sequence_begin(buffers); it != asio::buffer_sequence_end(buffers) && nRoom > 0; ++it)
+					{
+						asio::const_buffer b = *it;
+						size_t n = std::min(b.size(), nRoom);
+						Copy(nWrite, static_cast<const uint8_t*>(b.data()), n);
+						nWrite += n;
+						nRoom -= n;
+						nTotal += n;
+					}
+
+					if (nTotal > 0)
+						m_pControl->nWrite.store(nWrite, std::memory_order_seq_cst);
+					return nTotal;
+				}
+
+				//Copies as much as the ring holds, up to the size of buffers, and returns how many bytes that was.
+				//Consumer only.
+				template<typename MutableBufferSequence>
+				size_t Read(const MutableBufferSequence& buffers)
+				{
+					uint64_t nRead = m_pControl->nRead.load(std::memory_order_relaxed);
+					size_t nAvailable = Used(m_pControl->nWrite.load(std::memory_order_acquire), nRead);
+					size_t nTotal = 0;
+
+					for (auto it = asio::buffer_sequence_begin(buffers); it != asio::buffer_sequence_end(buffers) && nAvailable > 0; ++it)
+					{
+						asio::mutable_buffer b = *it;
+						size_t n = std::min(b.size(), nAvailable);
+						Copy(static_cast<uint8_t*>(b.data()), nRead, n);
+						nRead += n;
+						nAvailable -= n;
+						nTotal += n;
+					}
+
+					if (nTotal > 0)
+						m_pControl->nRead.store(nRead, std::memory_order_seq_cst);
+					return nTotal;
+				}
+
+				bool IsEmpty() const
+				{
+					return Used(m_pControl->nWrite.load(std::memory_order_acquire),
+						m_pControl->nRead.load(std::memory_order_relaxed)) == 0;
+				}
+
+				bool IsClosed() const
+				{
+					return m_pControl->bClosed.load(std::memory_order_acquire) != 0;
+				}
+
+			protected:
+				size_t Capacity() const
+				{
+					return m_nMask + 1;
+				}
+
+				//Bytes in the ring. The positions come from the other process, so one that is out of range is
+				//clamped rather than trusted.
+				size_t Used(uint64_t nWrite, uint64_t nRead) const
+				{
+					return size_t(std::min<uint64_t>(nWrite - nRead, Capacity()));
+				}
+
+				void Copy(uint64_t nTo, const uint8_t* pFrom, size_t n)
+				{
+					size_t nStart = size_t(nTo & m_nMask);
+					size_t nFirst = std::min(n, Capacity() - nStart);
+					std::memcpy(m_pData + nStart, pFrom, nFirst);
+					std::memcpy(m_pData, pFrom + nFirst, n - nFirst);
+				}
+
+				void Copy(uint8_t* pTo, uint64_t nFrom, size_t n)
+				{
+					size_t nStart = size_t(nFrom & m_nMask);
+					size_t nFirst = std::min(n, Capacity() - nStart);
+					std::memcpy(pTo, m_pData + nStart, nFirst);
+					std::memcpy(pTo + nFirst, m_pData, n - nFirst);
+				}
+
+				shm_ring_control* m_pControl = nullptr;
+				uint8_t* m_pData = nullptr;
+				size_t m_nMask = 0;
+		};
+
+		//The shared memory transport. Made by the client with Create() and by the server with Accept(), both from a
+		//connected AF_UNIX socket. Only used from the thread running its io_context.
+		class shm_channel
+		{
+			public:
+				using executor_type = asio::any_io_executor;
+
+				//What the client sends along with the descriptors
+				struct offer
+				{
+					uint64_t nMagic = 0;
+					uint64_t nRingBytes = 0;
+				};
+				static constexpr uint64_t nOfferMagic = 0x314D485354454E4C;
+				//The descriptors in the order they are sent: memfd, then data and space doorbells of each ring
+				static constexpr size_t nFds = 5;
+
+				~shm_channel()
+				{
+					close();
+					if (m_pMap)
+						munmap(m_pMap, m_nMapBytes);
+				}
+
+				//Client side. nRingBytes is rounded up to a power of two. Throws std::system_error on failure.
+				static std::unique_ptr<shm_channel> Create(stream_socket socket, size_t nRingBytes)
+				{
+					size_t n = 4096;
+					while (n < nRingBytes) n <<= 1;
+
+					std::unique_ptr<shm_channel> p(new shm_channel(std::move(socket)));
+					std::array<int, nFds> vFds;
+					vFds.fill(-1);
+					auto CloseAll = [&vFds]() { for (int fd : vFds) if (fd >= 0) ::close(fd); };
+
+					vFds[0] = memfd_create("tl_net_shm", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+					for (size_t i = 1; i < nFds; i++)
+						vFds[i] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+					//The server only maps memory whose size can't change any more
+					if (std::find(vFds.begin(), vFds.end(), -1) != vFds.end() || ftruncate(vFds[0], off_t(MapBytes(n))) != 0
+						|| fcntl(vFds[0], F_ADD_SEALS, nSeals) != 0 || !p->Map(vFds[0], n, true))
+					{
+						int nError = errno;
+						CloseAll();
+						throw std::system_error(nError, std::generic_category(), "shared memory transport");
+					}
+
+					offer o;
+					o.nMagic = nOfferMagic;
+					o.nRingBytes = n;
+					bool bSent = SendFds(p->m_socket.native_handle(), o, vFds);
+					int nError = errno;
+
+					//The ring from client to server is ring 0
+					p->Bind(vFds[1], vFds[2], vFds[3], vFds[4], 0);
+					::close(vFds[0]);
+					if (!bSent)
+						throw std::system_error(nError, std::generic_category(), "shared memory transport");
+					return p;
+				}
+
+				//Server side, once the client's offer is there to be read. Returns nullptr if it isn't a valid offer.
+				static std::unique_ptr<shm_channel> Accept(stream_socket socket)
+				{
+					offer o;
+					std::array<int, nFds> vFds;
+					vFds.fill(-1);
+					if (!ReceiveFds(socket.native_handle(), o, vFds))
+						return nullptr;
+
+					std::unique_ptr<shm_channel> p(new shm_channel(std::move(socket)));
+					struct stat st {};
+					bool bDoorbells = true;
+					for (size_t i = 1; i < nFds; i++)
+						bDoorbells = bDoorbells && IsDoorbell(vFds[i]);
+
+					//Sealed first, so the size checked is the size for good
+					int nSealed = fcntl(vFds[0], F_GET_SEALS);
+					bool bValid = bDoorbells && o.nMagic == nOfferMagic && o.nRingBytes >= 4096
+						&& (o.nRingBytes & (o.nRingBytes - 1)) == 0 && o.nRingBytes <= (size_t(1) << 30)
+						&& nSealed >= 0 && (nSealed & nSeals) == nSeals
+						&& fstat(vFds[0], &st) == 0 && uint64_t(st.st_size) >= MapBytes(o.nRingBytes)
+						&& p->Map(vFds[0], size_t(o.nRingBytes), false);
+					::close(vFds[0]);
+					if (!bValid)
+					{
+						for (size_t i = 1; i < nFds; i++)
+							::close(vFds[i]);
+						return nullptr;
+					}
+
+					p->Bind(vFds[1], vFds[2], vFds[3], vFds[4], 1);
+					return p;
+				}
+
+				executor_type get_executor()
+				{
+					return m_socket.get_executor();
+				}
+
+				bool is_open() const
+				{
+					return m_bOpen;
+				}
+
+				void close()
+				{
+					if (!m_bOpen)
+						return;
+					m_bOpen = false;
+
+					//Wake the other side whichever way it is waiting, it then sees bClosed
+					m_tx.Control().bClosed.store(1, std::memory_order_seq_cst);
+					Ring(m_txData);
+					Ring(m_rxSpace);
+
+					asio::error_code ec;
+					m_rxData.close(ec);
+					m_txSpace.close(ec);
+					m_txData.close(ec);
+					m_rxSpace.close(ec);
+					m_socket.close(ec);
+				}
+
+				template<typename MutableBufferSequence, typename Handler>
+				void async_read_some(const MutableBufferSequence& buffers, Handler&& handler)
+				{
+					asio::async_compose<Handler, void(asio::error_code, std::size_t)>(
+						read_op<MutableBufferSequence>{ this, buffers }, handler, m_socket);
+				}
+
+				template<typename ConstBufferSequence, typename Handler>
+				void async_write_some(const ConstBufferSequence& buffers, Handler&& handler)
+				{
+					asio::async_compose<Handler, void(asio::error_code, std::size_t)>(
+						write_op<ConstBufferSequence>{ this, buffers }, handler, m_socket);
+				}
+
+			protected:
+				explicit shm_channel(stream_socket socket)
+					: m_socket(std::move(socket)), m_rxData(m_socket.get_executor()), m_txSpace(m_socket.get_executor()),
+					  m_txData(m_socket.get_executor()), m_rxSpace(m_socket.get_executor())
+				{
+				}
+
+				//Neither side can resize the memfd once these are set, nor take them off again
+				static constexpr int nSeals = F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL;
+
+				//True if fd is an eventfd, which it then makes non-blocking in case the client didn't
+				static bool IsDoorbell(int fd)
+				{
+					char vLink[64] = {};
+					std::string sProc = "/proc/self/fd/" + std::to_string(fd);
+					ssize_t n = readlink(sProc.c_str(), vLink, sizeof(vLink) - 1);
+					if (n <= 0 || std::string_view(vLink, size_t(n)) != "anon_inode:[eventfd]")
+						return false;
+
+					int nFlags = fcntl(fd, F_GETFL);
+					return nFlags >= 0 && fcntl(fd, F_SETFL, nFlags | O_NONBLOCK) == 0;
+				}
+
+				static size_t MapBytes(size_t nRingBytes)
+				{
+					return 2 * sizeof(shm_ring_control) + 2 * nRingBytes;
+				}
+
+				bool Map(int fd, size_t nRingBytes, bool bCreate)
+				{
+					m_nMapBytes = MapBytes(nRingBytes);
+					void* pMap = mmap(nullptr, m_nMapBytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+					if (pMap == MAP_FAILED)
+						return false;
+					m_pMap = pMap;
+
+					shm_ring_control* pControls = static_cast<shm_ring_control*>(pMap);
+					if (bCreate)
+					{
+						new (&pControls[0]) shm_ring_control();
+						new (&pControls[1]) shm_ring_control();
+					}
+
+					uint8_t* pData = reinterpret_cast<uint8_t*>(pControls + 2);
+					m_vRings[0].Attach(&pControls[0], pData, nRingBytes);
+					m_vRings[1].Attach(&pControls[1], pData + nRingBytes, nRingBytes);
+					return true;
+				}
+
+				//nSide is 0 for the client, which writes ring 0, and 1 for the server
+				void Bind(int fdData0, int fdSpace0, int fdData1, int fdSpace1, size_t nSide)
+				{
+					std::array<int, 2> vData = { fdData0, fdData1 };
+					std::array<int, 2> vSpace = { fdSpace0, fdSpace1 };
+					size_t nTx = nSide, nRx = 1 - nSide;
+
+					m_tx = m_vRings[nTx];
+					m_rx = m_vRings[nRx];
+					m_txData.assign(vData[nTx]);
+					m_txSpace.assign(vSpace[nTx]);
+					m_rxData.assign(vData[nRx]);
+					m_rxSpace.assign(vSpace[nRx]);
+					m_bOpen = true;
+
+					//The socket carries nothing more. It becoming readable means the other process has closed it,
+					//perhaps by dying, so anyone waiting for it is woken up to find out.
+					m_socket.async_wait(stream_socket::wait_read, [this](asio::error_code ec)
+						{
+							if (ec == asio::error::operation_aborted || !m_bOpen)
+								return;
+							m_bPeerGone = true;
+							Ring(m_rxData);
+							Ring(m_txSpace);
+						});
+				}
+
+				static void Ring(asio::posix::stream_descriptor& doorbell)
+				{
+					if (!doorbell.is_open())
+						return;
+					uint64_t nOne = 1;
+					[[maybe_unused]] ssize_t n = ::write(doorbell.native_handle(), &nOne, sizeof(nOne));
+				}
+
+				static void Drain(asio::posix::stream_descriptor& doorbell)
+				{
+					uint64_t nCount;
+					[[maybe_unused]] ssize_t n = ::read(doorbell.native_handle(), &nCount, sizeof(nCount));
+				}
+
+				//The other side has gone: it closed its outgoing ring, or its process closed the socket
+				bool IsPeerClosed() const
+				{
+					return m_bPeerGone || m_rx.IsClosed();
+				}
+
+				template<typename MutableBufferSequence>
+				struct read_op
+				{
+					shm_channel* p;
+					MutableBufferSequence buffers;
+					bool bStarted = false;
+					bool bWaiting = false;
+
+					template<typename Self>
+					void operator()(Self& self, asio::error_code ec = {})
+					{
+						//Completion always comes from the io_context, never from inside async_read_some
+						if (!bStarted)
+						{
+							bStarted = true;
+							asio::post(p->get_executor(), std::move(self));
+							return;
+						}
+
+						if (ec || !p->m_bOpen)
+						{
+							self.complete(ec ? ec : asio::error_code(asio::error::operation_aborted), 0);
+							return;
+						}
+
+						if (bWaiting)
+							Drain(p->m_rxData);
+
+						for (;;)
+						{
+							size_t n = p->m_rx.Read(buffers);
+							if (n > 0 || asio::buffer_size(buffers) == 0)
+							{
+								p->m_rx.Control().bReaderWaiting.store(0, std::memory_order_relaxed);
+								if (p->m_rx.Control().bWriterWaiting.exchange(0, std::memory_order_seq_cst))
+									Ring(p->m_rxSpace);
+								self.complete({}, n);
+								return;
+							}
+
+							if (p->IsPeerClosed())
+							{
+								self.complete(asio::error::eof, 0);
+								return;
+							}
+
+							//Say we are about to sleep, then look once more, in case the writer published just before
+							//it could see that
+							if (p->m_rx.Control().bReaderWaiting.exchange(1, std::memory_order_seq_cst) == 0)
+								continue;
+
+							bWaiting = true;
+							p->m_rxData.async_wait(asio::posix::stream_descriptor::wait_read, std::move(self));
+							return;
+						}
+					}
+				};
+
+				template<typename ConstBufferSequence>
+				struct write_op
+				{
+					shm_channel* p;
+					ConstBufferSequence buffers;
+					bool bStarted = false;
+					bool bWaiting = false;
+
+					template<typename Self>
+					void operator()(Self& self, asio::error_code ec = {})
+					{
+						if (!bStarted)
+						{
+							bStarted = true;
+							asio::post(p->get_executor(), std::move(self));
+							return;
+						}
+
+						if (ec || !p->m_bOpen)
+						{
+							self.complete(ec ? ec : asio::error_code(asio::error::operation_aborted), 0);
+							return;
+						}
+
+						if (bWaiting)
+							Drain(p->m_txSpace);
+
+						for (;;)
+						{
+							if (p->IsPeerClosed())
+							{
+								self.complete(asio::error::broken_pipe, 0);
+								return;
+							}
+
+							size_t n = p->m_tx.Write(buffers);
+							if (n > 0 || asio::buffer_size(buffers) == 0)
+							{
+								p->m_tx.Control().bWriterWaiting.store(0, std::memory_order_relaxed);
+								if (p->m_tx.Control().bReaderWaiting.exchange(0, std::memory_order_seq_cst))
+									Ring(p->m_txData);
+								self.complete({}, n);
+								return;
+							}
+
+							if (p->m_tx.Control().bWriterWaiting.exchange(1, std::memory_order_seq_cst) == 0)
+								continue;
+
+							bWaiting = true;
+							p->m_txSpace.async_wait(asio::posix::stream_descriptor::wait_read, std::move(self));
+							return;
+						}
+					}
+				};
+
+				static bool SendFds(int fdSocket, const offer& o, const std::array<int, nFds>& vFds)
+				{
+					msghdr msg{};
+					iovec iov{ const_cast<offer*>(&o), sizeof(o) };
+					alignas(cmsghdr) char vControl[CMSG_SPACE(sizeof(int) * nFds)]{};
+					msg.msg_iov = &iov;
+					msg.msg_iovlen = 1;
+					msg.msg_control = vControl;
+					msg.msg_controllen = sizeof(vControl);
+
+					cmsghdr* pCmsg = CMSG_FIRSTHDR(&msg);
+					pCmsg->cmsg_level = SOL_SOCKET;
+					pCmsg->cmsg_type = SCM_RIGHTS;
+					pCmsg->cmsg_len = CMSG_LEN(sizeof(int) * nFds);
+					std::memcpy(CMSG_DATA(pCmsg), vFds.data(), sizeof(int) * nFds);
+
+					ssize_t n;
+					do
+						n = ::sendmsg(fdSocket, &msg, MSG_NOSIGNAL);
+					while (n < 0 && errno == EINTR);
+					return n == ssize_t(sizeof(o));
+				}
+
+				static bool ReceiveFds(int fdSocket, offer& o, std::array<int, nFds>& vFds)
+				{
+					msghdr msg{};
+					iovec iov{ &o, sizeof(o) };
+					alignas(cmsghdr) char vControl[CMSG_SPACE(sizeof(int) * nFds)]{};
+					msg.msg_iov = &iov;
+					msg.msg_iovlen = 1;
+					msg.msg_control = vControl;
+					msg.msg_controllen = sizeof(vControl);
+
+					ssize_t n;
+					do
+						n = ::recvmsg(fdSocket, &msg, MSG_CMSG_CLOEXEC | MSG_DONTWAIT);
+					while (n < 0 && errno == EINTR);
+
+					cmsghdr* pCmsg = CMSG_FIRSTHDR(&msg);
+					bool bFds = pCmsg && pCmsg->cmsg_level == SOL_SOCKET && pCmsg->cmsg_type == SCM_RIGHTS
+						&& pCmsg->cmsg_len == CMSG_LEN(sizeof(int) * nFds);
+					if (bFds)
+						std::memcpy(vFds.data(), CMSG_DATA(pCmsg), sizeof(int) * nFds);
+					else if (pCmsg && pCmsg->cmsg_level == SOL_SOCKET && pCmsg->cmsg_type == SCM_RIGHTS)
+					{
+						//Some other number of descriptors, don't leak them
+						size_t nGot = (pCmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+						for (size_t i = 0; i < nGot; i++)
+						{
+							int fd;
+							std::memcpy(&fd, CMSG_DATA(pCmsg) + i * sizeof(int), sizeof(int));
+							::close(fd);
+						}
+					}
+
+					return bFds && n == ssize_t(sizeof(o)) && !(msg.msg_flags & MSG_CTRUNC);
+				}
+
+				stream_socket m_socket;
+				asio::posix::stream_descriptor m_rxData;
+				asio::posix::stream_descriptor m_txSpace;
+				//Rung for the other side, never waited on here
+				asio::posix::stream_descriptor m_txData;
+				asio::posix::stream_descriptor m_rxSpace;
+
+				void* m_pMap = nullptr;
+				size_t m_nMapBytes = 0;
+				std::array<shm_ring, 2> m_vRings;
+				shm_ring m_tx;
+				shm_ring m_rx;
+				bool m_bOpen = false;
+				bool m_bPeerGone = false;
+		};
+
+		//The stream a Connection reads and writes: a socket, or a shm_channel standing in for one
+		class transport_stream
+		{
+			public:
+				using executor_type = asio::any_io_executor;
+
+				template<typename Protocol, typename Executor>
+				transport_stream(asio::basic_stream_socket<Protocol, Executor>&& socket)
+					: m_socket(std::move(socket))
+				{
+				}
+
+				explicit transport_stream(std::unique_ptr<shm_channel> pShm)
+					: m_socket(pShm->get_executor()), m_pShm(std::move(pShm))
+				{
+				}
+
+				executor_type get_executor()
+				{
+					return m_socket.get_executor();
+				}
+
+				bool is_open() const
+				{
+					return m_pShm ? m_pShm->is_open() : m_socket.is_open();
+				}
+
+				void close()
+				{
+					if (m_pShm)
+						m_pShm->close();
+					else
+						m_socket.close();
+				}
+
+				//The socket underneath, for what only a socket can do (connecting, socket options, sendfile). Null
+				//for shared memory.
+				stream_socket* socket()
+				{
+					return m_pShm ? nullptr : &m_socket;
+				}
+
+				template<typename MutableBufferSequence, typename Token>
+				auto async_read_some(const MutableBufferSequence& buffers, Token&& token)
+				{
+					return asio::async_initiate<Token, void(asio::error_code, std::size_t)>(
+						[this](auto handler, const MutableBufferSequence& buffers)
+						{
+							if (m_pShm)
+								m_pShm->async_read_some(buffers, std::move(handler));
+							else
+								m_socket.async_read_some(buffers, std::move(handler));
+						}, token, buffers);
+				}
+
+				template<typename ConstBufferSequence, typename Token>
+				auto async_write_some(const ConstBufferSequence& buffers, Token&& token)
+				{
+					return asio::async_initiate<Token, void(asio::error_code, std::size_t)>(
+						[this](auto handler, const ConstBufferSequence& buffers)
+						{
+							if (m_pShm)
+								m_pShm->async_write_some(buffers, std::move(handler));
+							else
+								m_socket.async_write_some(buffers, std::move(handler));
+						}, token, buffers);
+				}
+
+			protected:
+				stream_socket m_socket;
+				std::unique_ptr<shm_channel> m_pShm;
+		};
+	}
+}
+
+#endif
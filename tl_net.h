@@ -4,9 +4,19 @@
 #include "net_base.h"
 #include "net_info.h"
 #include "net_threadsafeQueue.hpp"
+#include "net_mpscQueue.hpp"
+#include "net_readiness.hpp"
+#include "net_transport.hpp"
+#include "net_slotMap.hpp"
+#include "net_log.hpp"
+#include "net_metrics.hpp"
+#include "net_timerWheel.hpp"
+#include "net_bufferPool.hpp"
 #include "net_client.h"
 #include "net_server.h"
 #include "net_connection.h"
 #include "user_command.h"
+#include "net_fileTransfer.h"
+#include "net_playback.h"
 
 #endif